@@ -0,0 +1,88 @@
+import io
+import os
+import sys
+import time
+import subprocess
+import argparse
+import concurrent.futures
+
+# Run from the root of the repository, where methanol.py expects the compiler to be.
+ROOT = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, ROOT)
+import methanol
+
+
+def load(file):
+    """Returns the lines of a quad file, compiling it first if it's a source file, along with the messages of
+    the compiler. The lines are None if the program couldn't be loaded.
+    Runs in a worker process, so it has to be a top level function."""
+    log = io.StringIO()
+    try:
+        if file.endswith(".quad"):
+            with open(file) as quads:
+                return [line.strip() for line in quads.readlines()], ""
+        return methanol.compile(file, log=log), log.getvalue()
+    except subprocess.CalledProcessError:
+        # The compiler already explained why in the log.
+        return None, log.getvalue() + "Error: The program failed to compile.\n"
+    except Exception as error:
+        # A missing file... only this program is affected.
+        return None, log.getvalue() + "Error: " + str(error) + "\n"
+
+def run_one(job):
+    """Runs a single loaded program in its own VM, returning its output instead of printing it.
+    Runs in a worker process, so it has to be a top level function."""
+    (program, log), max_steps, timeout = job
+    if program is None:
+        return log, False, 0.0
+    output = io.StringIO()
+    output.write(log)
+    start = time.perf_counter()
+    try:
+        methanol.run(program, output=output, max_steps=max_steps, timeout=timeout)
+        ok = True
+    except Exception as error:
+        output.write("Error: " + str(error) + "\n")
+        ok = False
+    return output.getvalue(), ok, time.perf_counter() - start
+
+def main(files, jobs=None, max_steps=None, timeout=None):
+    """Runs the programs in `jobs` worker processes (one per core by default), printing their outputs in order.
+    Processes are used instead of threads because the VM is pure Python and would hold the GIL."""
+    # The compiler is run from the root of the repository, so the paths are made absolute first.
+    paths = [os.path.abspath(file) for file in files]
+    os.chdir(ROOT)
+    methanol.build()
+    failed = 0
+    start = time.perf_counter()
+    with concurrent.futures.ProcessPoolExecutor(max_workers=jobs) as executor:
+        # The compiler writes its output next to the source file, so each file is compiled only once
+        # (still in parallel) before any program runs.
+        unique = list(dict.fromkeys(paths))
+        programs = dict(zip(unique, executor.map(load, unique)))
+        results = executor.map(run_one, [(programs[path], max_steps, timeout) for path in paths])
+        for file, (output, ok, elapsed) in zip(files, results):
+            print("== %s (%.3fs)" % (file, elapsed))
+            print(output, end="", flush=True)
+            failed += not ok
+    print("%d program(s), %d failed, %.3fs" % (len(files), failed, time.perf_counter() - start), file=sys.stderr)
+    return failed == 0
+
+def positive(type):
+    """An argparse type for the positive numbers of the given type."""
+    def parse(text):
+        value = type(text)
+        if value <= 0:
+            raise argparse.ArgumentTypeError("%s is not positive" % text)
+        return value
+    return parse
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Runs many methanol programs (.meth or compiled .quad files) concurrently.")
+    parser.add_argument("files", nargs="+")
+    parser.add_argument("-j", "--jobs", type=positive(int), help="the number of worker processes (the number of cores by default)")
+    parser.add_argument("--max-steps", type=positive(int), help="stop each program after this many instructions")
+    parser.add_argument("--timeout", type=positive(float), help="stop each program after this many seconds")
+    args = parser.parse_args()
+    sys.exit(0 if main(args.files, args.jobs, args.max_steps, args.timeout) else 1)
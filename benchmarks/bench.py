@@ -0,0 +1,78 @@
+import io
+import os
+import sys
+import time
+import tempfile
+import contextlib
+
+# Run from the root of the repository, where methanol.py expects the compiler to be.
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, ROOT)
+os.chdir(ROOT)
+import methanol
+
+
+def count_quads(program):
+    """Returns the number of instructions in a program, ignoring labels and comments."""
+    return len([line for line in program if line and not line.startswith(("/*", "LABEL", "DEF"))])
+
+def measure(program, repeat):
+    """Runs a program `repeat` times and returns the best time along with its output."""
+    best = None
+    for _ in range(repeat):
+        output = io.StringIO()
+        start = time.perf_counter()
+        with contextlib.redirect_stdout(output):
+            methanol.run(program)
+        elapsed = time.perf_counter() - start
+        best = elapsed if best is None else min(best, elapsed)
+    return best, output.getvalue()
+
+# The optimized compilation of the program made by `helpers_program` has to take less than this many seconds,
+# an optimizer that doesn't scale with the number of functions takes minutes.
+COMPILE_TIME_LIMIT = 10
+
+def helpers_program(count):
+    """Returns a program made of `count` small functions, each calling the previous one twice, and a top level
+    calling every one of them. It is only compiled: running it would take 2 ** count calls."""
+    lines = ["int h0(int x) {", "    return x + 1;", "}"]
+    for i in range(1, count):
+        lines += ["int h%d(int x) {" % i, "    return h%d(x) * 2 + h%d(x + %d);" % (i - 1, i - 1, i), "}"]
+    lines += ["int total = 0;"] + ["total = total + h%d(total);" % i for i in range(count)] + ["print total;"]
+    return "\n".join(lines) + "\n"
+
+def check_compile_time(count=200):
+    """Times the compilation of a program with many functions, with and without optimizations."""
+    with tempfile.TemporaryDirectory() as directory:
+        file = os.path.join(directory, "helpers.meth")
+        with open(file, "w") as source:
+            source.write(helpers_program(count))
+        times = []
+        for flags in (["-O0"], []):
+            start = time.perf_counter()
+            methanol.compile(file, flags, log=io.StringIO())
+            times.append(time.perf_counter() - start)
+    print("%-28s %10s %10s %9.3fs %9.3fs   (compile time)" % ("%d helpers" % count, "", "", times[0], times[1]))
+    if times[1] > COMPILE_TIME_LIMIT:
+        sys.exit("Compiling %d helpers took %.1fs, more than %ds." % (count, times[1], COMPILE_TIME_LIMIT))
+
+def main(files, repeat=3):
+    print("%-28s %10s %10s %10s %10s %8s" % ("Benchmark", "Quads -O0", "Quads", "Time -O0", "Time", "Speedup"))
+    for file in files:
+        unoptimized = methanol.compile(file, ["-O0"])
+        optimized = methanol.compile(file)
+        slow, expected = measure(unoptimized, repeat)
+        fast, output = measure(optimized, repeat)
+        if output != expected:
+            sys.exit("The optimized %s printed a different output." % file)
+        print("%-28s %10d %10d %9.3fs %9.3fs %7.2fx" % (
+            os.path.basename(file), count_quads(unoptimized), count_quads(optimized), slow, fast, slow / fast))
+        os.remove(file + ".quad")
+    check_compile_time()
+
+
+if __name__ == "__main__":
+    # Runs the given benchmarks, or all of them. Their sizes go through `opaque`, since the compiler would
+    # evaluate calls on constant arguments (and the whole benchmark with them) at compile time.
+    benchmarks = os.path.join(ROOT, "benchmarks")
+    main(sys.argv[1:] or sorted(os.path.join(benchmarks, f) for f in os.listdir(benchmarks) if f.endswith(".meth")))
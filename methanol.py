@@ -1,6 +1,10 @@
 import os
 import sys
+import time
+import operator
 import subprocess
+from array import array
+from itertools import repeat
 
 
 def is_expr(expr):
@@ -29,118 +33,299 @@ def to_expr(expr):
     else:
         return int(expr)
 
+def array_of(values, like):
+    """Makes an array of the given values with the element type of `like` (a number or an array)."""
+    typecode = like.typecode if isinstance(like, array) else "d" if isinstance(like, float) else "q"
+    try:
+        return array(typecode, values)
+    except OverflowError:
+        panic("Integer overflow in an array operation.")
+
+def elementwise(op, first, second):
+    """Applies a binary operation to arrays element by element, a number is used for every element."""
+    if isinstance(first, array) and isinstance(second, array) and len(first) != len(second):
+        panic("Arrays of different lengths (%d and %d) can't be operated on." % (len(first), len(second)))
+    # NOTE(arrays): map() over operator functions runs the loop in C, there's no SIMD in pure Python.
+    values = map(op, first if isinstance(first, array) else repeat(first), second if isinstance(second, array) else repeat(second))
+    # Comparisons give integer arrays of ones and zeros.
+    return array_of(values, 0 if op in COMPARISONS else first if isinstance(first, array) else second)
+
+def divide(first, second):
+    """Divides like DIV does."""
+    if second == 0:
+        panic("Division by zero.")
+    return first // second if isinstance(first, int) else first / second
+
+# The element-wise versions of the binary operations.
+VECTOR_OPERATIONS = {
+    "VPLUS": operator.add,
+    "VMINUS": operator.sub,
+    "VMULT": operator.mul,
+    "VDIV": divide,
+    "VLT": operator.lt,
+    "VGT": operator.gt,
+    "VLTEQ": operator.le,
+    "VGTEQ": operator.ge,
+    "VEQ": operator.eq,
+    "VNEQ": operator.ne,
+}
+COMPARISONS = (operator.lt, operator.gt, operator.le, operator.ge, operator.eq, operator.ne)
+
+class ProgramError(Exception):
+    """An error that stops the program, like a division by zero."""
+
 def panic(msg):
-    print("Error: " + msg)
-    exit(1)
+    raise ProgramError(msg)
 
-def main(file):
-    # Build the compiler if it doesn't exist.
+def build():
+    """Builds the compiler if it doesn't exist."""
     if not os.path.exists("compiler.exe"):
         subprocess.run(["bash", "build.sh"]).check_returncode()
 
-    # Run the compiler.
-    subprocess.run(["./compiler.exe", file]).check_returncode()
+def compile(file, flags=[], log=None):
+    """Compiles the given file and returns the lines of the resulting quad file.
+    The errors and warnings of the compiler are written to `log` if given, to stderr otherwise."""
+    build()
+
+    # Run the compiler, which would read the program from stdin if the file doesn't exist.
+    if not os.path.exists(file):
+        raise FileNotFoundError("No such file: " + file)
+    result = subprocess.run(["./compiler.exe", file] + flags, capture_output=log is not None, text=True)
+    if log is not None:
+        log.write(result.stderr)
+    result.check_returncode()
 
     # Remove the symbol table file.
     os.remove(file + ".sym")
 
     # Load the program.
-    program = [line.strip()  for line in open(file + ".quad").readlines()]
+    return [line.strip()  for line in open(file + ".quad").readlines()]
+
+# The maximum sizes of the operand stack and return stack (in values and calls).
+STACK_SIZE = 1 << 20
+CALL_DEPTH = 1 << 20
+# How often (in instructions) the time limit is checked.
+LIMIT_CHECK_INTERVAL = 4096
+
+def run(program, stack_size=STACK_SIZE, call_depth=CALL_DEPTH, output=None, max_steps=None, timeout=None):
+    """Interprets the lines of a quad file, printing to `output` (stdout by default).
+    The program is stopped with a ProgramError once it runs more than `max_steps` instructions or `timeout` seconds.
+    All the state of the VM is local to the call, so programs can run concurrently."""
+    # Comments and blank lines don't do anything, so they are dropped before running.
+    program = [line for line in program if line and not line.startswith("/*")]
 
     # Initialize the VM.
-    stack = []          # The stack of the VM.
-    variables = {}      # Runtime variables.
-    labels = {}         # For labels and functions.
-    index_stack = []    # For CALL and RET.
+    stack = []                      # The stack of the VM, `sp` is the index right above its top.
+    sp = 0
+    variables = {}                  # Runtime variables.
+    labels = {}                     # For labels and functions.
+    frames = {}                     # The arguments, maximum stack depth and saved variables of each function (and of "main").
+    index_stack = []                # For CALL and RET.
+    saved_stack = []                # The variables each call saved, restored when it returns.
 
-    # First, find all the labels and functions.
+    def reserve(size):
+        """Grows the stack to hold `size` values, at least doubling it so that deep calls only grow it a few times."""
+        if size > stack_size:
+            panic("Stack overflow.")
+        stack.extend([None] * (min(max(size, 2 * len(stack)), stack_size) - len(stack)))
+
+    # First, find all the labels and functions, and read the frames from the header.
     for index, line in enumerate(program):
         if line.startswith(("LABEL", "DEF")):
             labels[line.split()[1][:-1]] = index
+        elif line.startswith("FRAME"):
+            name, params, depth, _, *saved = line.split()[1:]
+            frames[name] = (int(params), int(depth), frozenset(saved))
+
+    # The compiler made sure that no frame goes deeper than it says, so the stack starts as deep as the top level
+    # needs and is only checked (and grown) at calls.
+    if "main" not in frames:
+        panic("The program has no FRAME header, it has to be recompiled.")
+    reserve(frames["main"][1])
+
+    # The instruction limit is exact, the time limit is checked every LIMIT_CHECK_INTERVAL instructions.
+    steps = 0
+    next_check = LIMIT_CHECK_INTERVAL if max_steps is None else min(LIMIT_CHECK_INTERVAL, max_steps)
+    deadline = None if timeout is None else time.perf_counter() + timeout
+    if max_steps is not None and max_steps < 1 and program:
+        panic("The program ran more than %d instructions." % max(max_steps, 0))
 
     # Run the program.
     index = 0
-    while True:
+    while index < len(program):
         line = program[index]
-        if line == "":
-            pass
-        elif line.startswith("/*"):
-            pass
-        elif line.startswith(("LABEL", "DEF")):
+        if line.startswith(("LABEL", "DEF", "FRAME")):
             pass
         elif line == "INT2REAL":
-            stack.append(float(stack.pop()))
+            stack[sp - 1] = float(stack[sp - 1])
         elif line == "REAL2INT":
-            stack.append(int(stack.pop()))
+            stack[sp - 1] = int(stack[sp - 1])
+        elif line == "OPAQUE":
+            pass    # The value is left as it is, the instruction only hides it from the optimizer.
         elif line == "POP":
-            stack.pop()
+            sp -= 1
         elif line == "PRINT":
-            print(stack.pop())
+            sp -= 1
+            print(stack[sp].tolist() if isinstance(stack[sp], array) else stack[sp], file=output)
         elif line.startswith("PUSH"):
             to_push = line.split(maxsplit=1)[1]
             if is_expr(to_push):
-                stack.append(to_expr(to_push))
+                stack[sp] = to_expr(to_push)
             else:
                 if variables.get(to_push) is None:
                     panic("Variable " + to_push + " is being used without being initialized.")
-                stack.append(variables[to_push])
+                stack[sp] = variables[to_push]
+            sp += 1
         elif line.startswith("DUP"):
-            stack.append(stack[-1])
+            stack[sp] = stack[sp - 1]
+            sp += 1
         elif line.startswith("POP"):
-            variables[line.split()[1]] = stack.pop()
+            sp -= 1
+            variables[line.split()[1]] = stack[sp]
+        # NOTE(binary operations): stack[sp - 2] is the first operand & stack[sp - 1] is the second.
+        # The result replaces the first operand.
         elif line == "PLUS":
-            stack.append(stack.pop() + stack.pop())
-        # NOTE(MINUS, DIV, LT, GT, ...): stack[-2] is the first operand & stack[-1] is the second. Popping happens in reverse order.
+            sp -= 1
+            stack[sp - 1] = stack[sp] + stack[sp - 1]
         elif line == "MINUS":
-            stack.append(-stack.pop() + stack.pop())
+            sp -= 1
+            stack[sp - 1] = stack[sp - 1] - stack[sp]
         elif line == "MULT":
-            stack.append(stack.pop() * stack.pop())
+            sp -= 1
+            stack[sp - 1] = stack[sp] * stack[sp - 1]
         elif line == "DIV":
-            second = stack.pop()
-            first = stack.pop()
+            sp -= 1
+            second = stack[sp]
+            first = stack[sp - 1]
             if second == 0:
                 panic("Division by zero.")
             # Note that both operands gonna be of the same type anyways (int or float).
             if isinstance(first, int):
-                stack.append(first // second)
+                stack[sp - 1] = first // second
             else:
-                stack.append(first / second)
+                stack[sp - 1] = first / second
         elif line == "NEG":
-            stack.append(-stack.pop())
+            stack[sp - 1] = -stack[sp - 1]
         elif line == "LT":
-            stack.append(stack.pop() > stack.pop())
+            sp -= 1
+            stack[sp - 1] = stack[sp - 1] < stack[sp]
         elif line == "GT":
-            stack.append(stack.pop() < stack.pop())
+            sp -= 1
+            stack[sp - 1] = stack[sp - 1] > stack[sp]
         elif line == "LTEQ":
-            stack.append(stack.pop() >= stack.pop())
+            sp -= 1
+            stack[sp - 1] = stack[sp - 1] <= stack[sp]
         elif line == "GTEQ":
-            stack.append(stack.pop() <= stack.pop())
+            sp -= 1
+            stack[sp - 1] = stack[sp - 1] >= stack[sp]
         elif line == "EQ":
-            stack.append(stack.pop() == stack.pop())
+            sp -= 1
+            stack[sp - 1] = stack[sp] == stack[sp - 1]
         elif line == "NEQ":
-            stack.append(stack.pop() != stack.pop())
+            sp -= 1
+            stack[sp - 1] = stack[sp] != stack[sp - 1]
         elif line == "AND":
-            stack.append(stack.pop() and stack.pop())
+            sp -= 1
+            stack[sp - 1] = stack[sp] and stack[sp - 1]
         elif line == "OR":
-            stack.append(stack.pop() or stack.pop())
+            sp -= 1
+            stack[sp - 1] = stack[sp] or stack[sp - 1]
         elif line == "NOT":
-            stack.append(not stack.pop())
+            stack[sp - 1] = not stack[sp - 1]
+        elif line.startswith("ARRAY"):
+            count = int(line.split()[1])
+            sp -= count
+            stack[sp] = array_of(stack[sp:sp + count], stack[sp])
+            sp += 1
+        elif line == "FILL":
+            sp -= 1
+            if stack[sp] < 0:
+                panic("Arrays can't have a negative length.")
+            stack[sp - 1] = array_of([stack[sp - 1]], stack[sp - 1]) * stack[sp]
+        elif line == "COPY":
+            stack[sp - 1] = array_of(stack[sp - 1], stack[sp - 1])
+        # NOTE(VGET, VSET): The array is pushed last, right above the index (and the value to store for VSET).
+        elif line == "VGET":
+            sp -= 1
+            if not 0 <= stack[sp - 1] < len(stack[sp]):
+                panic("Index %d is out of the bounds of an array of length %d." % (stack[sp - 1], len(stack[sp])))
+            stack[sp - 1] = stack[sp][stack[sp - 1]]
+        elif line == "VSET":
+            sp -= 3
+            if not 0 <= stack[sp] < len(stack[sp + 2]):
+                panic("Index %d is out of the bounds of an array of length %d." % (stack[sp], len(stack[sp + 2])))
+            try:
+                stack[sp + 2][stack[sp]] = stack[sp + 1]
+            except OverflowError:
+                panic("Integer overflow in an array operation.")
+        elif line == "VLEN":
+            stack[sp - 1] = len(stack[sp - 1])
+        elif line == "VSUM":
+            stack[sp - 1] = sum(stack[sp - 1])
+        elif line in ("VMIN", "VMAX"):
+            if len(stack[sp - 1]) == 0:
+                panic("The minimum or maximum of an empty array doesn't exist.")
+            stack[sp - 1] = (min if line == "VMIN" else max)(stack[sp - 1])
+        elif line == "VNEG":
+            stack[sp - 1] = array_of(map(operator.neg, stack[sp - 1]), stack[sp - 1])
+        elif line in VECTOR_OPERATIONS:
+            sp -= 1
+            stack[sp - 1] = elementwise(VECTOR_OPERATIONS[line], stack[sp - 1], stack[sp])
         elif line.startswith("JMP"):
             index = labels[line.split()[1]]
         elif line.startswith("JZ"):
-            if stack.pop() == 0:
+            sp -= 1
+            if stack[sp] == 0:
                 index = labels[line.split()[1]]
+        # NOTE(recursion): Every invocation of a recursive function gets its own copy of its variables,
+        # the caller's values are saved on the call and restored on the return.
         elif line.startswith("CALL"):
+            func = line.split()[1]
+            params, depth, saved = frames[func]
+            if sp - params + depth > len(stack):
+                reserve(sp - params + depth)
+            if len(index_stack) == call_depth:
+                panic("Stack overflow.")
             index_stack.append(index)
-            index = labels[line.split()[1]]
+            saved_stack.append({var: variables.get(var) for var in saved} if saved else None)
+            index = labels[func]
+        # NOTE(TAILCALL): The callee returns straight to our caller, so no return address is pushed.
+        # What it saves is restored along with what the current function saved, whose values come last.
+        elif line.startswith("TAILCALL"):
+            func = line.split()[1]
+            params, depth, saved = frames[func]
+            if sp - params + depth > len(stack):
+                reserve(sp - params + depth)
+            current = saved_stack[-1]
+            if current is None and saved:
+                saved_stack[-1] = {var: variables.get(var) for var in saved}
+            elif saved and not current.keys() >= saved:
+                saved_stack[-1] = {**{var: variables.get(var) for var in saved}, **current}
+            index = labels[func]
         elif line == "RET":
             index = index_stack.pop()
+            current = saved_stack.pop()
+            if current is not None:
+                variables.update(current)
         else:
             panic("Invalid instruction: " + line)
 
         index += 1
-        if index >= len(program):
-            break
+        steps += 1
+        if steps >= next_check:
+            if max_steps is not None and steps >= max_steps and index < len(program):
+                panic("The program ran more than %d instructions." % max_steps)
+            if deadline is not None and time.perf_counter() > deadline:
+                panic("The program ran for more than %g seconds." % timeout)
+            next_check = steps + LIMIT_CHECK_INTERVAL if max_steps is None else min(steps + LIMIT_CHECK_INTERVAL, max_steps)
+
+
+def main(file):
+    try:
+        run(compile(file))
+    except ProgramError as error:
+        print("Error: " + str(error))
+        exit(1)
 
 
 if __name__ == "__main__":
@@ -0,0 +1,544 @@
+// This file contains the control-flow graph that the optimizer builds out of the emitted quads.
+#pragma once
+#include <set>
+#include <sstream>
+
+// Whether the operand of a PUSH is an immediate value (mirrors `is_expr` in methanol.py).
+bool is_immediate(string arg)
+{
+    return arg != "" && (arg[0] == '"' || arg[0] == '-' || arg[0] == '.' || isdigit(arg[0]) || arg == "true" || arg == "false");
+}
+
+// A single line of the quad file.
+struct Quad
+{
+    // The instruction (PUSH, JZ, etc...), LABEL or DEF for labels, and empty for comments and blank lines.
+    string op;
+    // The operand of the instruction, the name of the label, or the raw text of a comment.
+    string arg;
+
+    Quad(string op, string arg)
+    {
+        this->op = op;
+        this->arg = arg;
+    }
+
+    // Parses a line of the quad file.
+    Quad(string line)
+    {
+        if (line.rfind("LABEL ", 0) == 0 || line.rfind("DEF ", 0) == 0)
+        {
+            int space = line.find(' ');
+            this->op = line.substr(0, space);
+            this->arg = line.substr(space + 1, line.size() - space - 2); // Drop the ':'.
+        }
+        else if (line == "" || line.rfind("/*", 0) == 0)
+        {
+            this->op = "";
+            this->arg = line;
+        }
+        else
+        {
+            line = line.substr(line.find_first_not_of('\t'));
+            int space = line.find(' ');
+            this->op = space == string::npos ? line : line.substr(0, space);
+            this->arg = space == string::npos ? "" : line.substr(space + 1);
+        }
+    }
+
+    string str()
+    {
+        if (this->is_label())
+            return this->op + " " + this->arg + ":";
+        if (!this->is_code())
+            return this->arg;
+        return "\t" + this->op + (this->arg == "" ? "" : " " + this->arg);
+    }
+
+    // Comments and blank lines are not code.
+    bool is_code() { return this->op != ""; }
+    bool is_label() { return this->op == "LABEL" || this->op == "DEF"; }
+    bool is_jump() { return this->op == "JMP" || this->op == "JZ"; }
+    bool is_terminator() { return this->is_jump() || this->is_return(); }
+    // A TAILCALL is a CALL and a RET at once: the callee returns straight to the caller's caller.
+    bool is_call() { return this->op == "CALL" || this->op == "TAILCALL"; }
+    bool is_return() { return this->op == "RET" || this->op == "TAILCALL"; }
+    // Array operations read and write memory that isn't tracked through variables, allocate new arrays
+    // or fail on bad indices and lengths, so the optimizer never moves or removes them.
+    bool is_array_op() { return this->op == "ARRAY" || this->op == "FILL" || this->op == "COPY" || (this->op.size() > 1 && this->op[0] == 'V'); }
+    // A PUSH of a variable, as opposed to an immediate.
+    bool is_load() { return this->op == "PUSH" && !is_immediate(this->arg); }
+    // A POP into a variable, as opposed to a POP that discards the value.
+    bool is_store() { return this->op == "POP" && this->arg != ""; }
+};
+
+vector<Quad> read_quads(string path)
+{
+    vector<Quad> quads;
+    ifstream in(path);
+    string line;
+    while (getline(in, line))
+        quads.push_back(Quad(line));
+    return quads;
+}
+
+void write_quads(string path, vector<Quad> &quads)
+{
+    ofstream out(path);
+    for (Quad &q : quads)
+        out << q.str() << endl;
+}
+
+// The number of arguments each function (by its DEF label) pops off the stack.
+// Parameters are popped right after the DEF, so it is computed once on the unoptimized quads.
+map<string, int> func_arity;
+void compute_func_arity(vector<Quad> &quads)
+{
+    for (int i = 0; i < quads.size(); i++)
+        if (quads[i].op == "DEF")
+        {
+            int arity = 0;
+            for (int j = i + 1; j < quads.size() && quads[j].op == "POP"; j++)
+                arity++;
+            func_arity[quads[i].arg] = arity;
+        }
+}
+
+// How many values an instruction pops off the stack and pushes back onto it.
+void stack_effect(Quad &q, int &pops, int &pushes)
+{
+    pops = pushes = 0;
+    if (q.op == "PUSH")
+        pushes = 1;
+    else if (q.op == "POP" || q.op == "PRINT" || q.op == "JZ")
+        pops = 1;
+    else if (q.op == "DUP")
+        pops = 1, pushes = 2;
+    else if (q.op == "NEG" || q.op == "NOT" || q.op == "INT2REAL" || q.op == "REAL2INT" || q.op == "OPAQUE")
+        pops = 1, pushes = 1;
+    else if (q.op == "VNEG" || q.op == "COPY" || q.op == "VLEN" || q.op == "VSUM" || q.op == "VMIN" || q.op == "VMAX")
+        pops = 1, pushes = 1;
+    else if (q.op == "ARRAY")
+        pops = atoi(q.arg.c_str()), pushes = 1;
+    else if (q.op == "VSET")
+        pops = 3;
+    else if (q.op == "CALL")
+        pops = func_arity[q.arg], pushes = 1;
+    else if (q.op == "TAILCALL")
+        pops = func_arity[q.arg];
+    else if (q.op == "RET")
+        pops = 1;
+    else if (q.is_code() && !q.is_label() && q.op != "JMP" && q.op != "FRAME")
+        pops = 2, pushes = 1; // Binary operations.
+}
+
+// The label of a function's end (where its definition is jumped over) given its DEF label.
+string func_end_label(string def)
+{
+    return "fend_" + def.substr(2);
+}
+
+// Adds the functions called (directly or not) by `func` to `order` before `func` itself.
+void order_callees_first(string func, map<string, set<string>> &callees, set<string> &visited, vector<string> &order)
+{
+    if (!visited.insert(func).second)
+        return;
+    for (string callee : callees[func])
+        order_callees_first(callee, callees, visited, order);
+    order.push_back(func);
+}
+
+// A maximal straight-line sequence of quads, entered only at the top and left only at the bottom.
+struct Block
+{
+    // The quads [start, end) of this block.
+    int start;
+    int end;
+    // The index of the last instruction in the block, -1 if it has none.
+    int last;
+    vector<int> succs;
+    vector<int> preds;
+    // The function (by its DEF label) this block belongs to, empty for top level code.
+    string func;
+    bool reachable;
+    set<string> live_in;
+    set<string> live_out;
+    // The blocks that every path from the entry (of the program or the function) to this block goes through.
+    set<int> dominators;
+    // The variables that have been assigned a value on every path reaching the end of this block.
+    set<string> assigned_out;
+};
+
+// A natural loop: the header dominates every block in the loop, and it is entered only through the header.
+struct Loop
+{
+    int header;
+    set<int> blocks;
+};
+
+struct Cfg
+{
+    vector<Quad> &quads;
+    vector<Block> blocks;
+    // The block each quad belongs to.
+    vector<int> block_of;
+    // The block each label (or function) starts.
+    map<string, int> label_block;
+    // The variables referenced inside each function's body, including the bodies of everything it calls.
+    map<string, set<string>> func_refs;
+    // The variables referenced anywhere outside each function's body.
+    map<string, set<string>> func_escaping;
+    // The functions each function calls, directly or indirectly.
+    map<string, set<string>> func_calls;
+
+    Cfg(vector<Quad> &quads) : quads(quads)
+    {
+        this->build_blocks();
+        this->build_edges();
+        this->compute_func_refs();
+        this->compute_reachability();
+    }
+
+    Quad &last(Block &b)
+    {
+        return this->quads[b.last];
+    }
+
+    void build_blocks()
+    {
+        // A new block starts at every label and at the first instruction after a jump or return.
+        bool after_terminator = true;
+        vector<string> funcs;
+        for (int i = 0; i < this->quads.size(); i++)
+        {
+            Quad &q = this->quads[i];
+            if (q.op == "DEF")
+                funcs.push_back(q.arg);
+            else if (q.op == "LABEL" && !funcs.empty() && q.arg == func_end_label(funcs.back()))
+                funcs.pop_back();
+
+            if (this->blocks.empty() || q.is_label() || (after_terminator && q.is_code()))
+            {
+                if (!this->blocks.empty())
+                    this->blocks.back().end = i;
+                Block b;
+                b.start = i;
+                b.last = -1;
+                b.func = funcs.empty() ? "" : funcs.back();
+                b.reachable = false;
+                this->blocks.push_back(b);
+                after_terminator = false;
+            }
+            if (q.is_label())
+                this->label_block[q.arg] = this->blocks.size() - 1;
+            else if (q.is_code())
+            {
+                this->blocks.back().last = i;
+                after_terminator = q.is_terminator();
+            }
+            this->block_of.push_back(this->blocks.size() - 1);
+        }
+        if (!this->blocks.empty())
+            this->blocks.back().end = this->quads.size();
+    }
+
+    void build_edges()
+    {
+        for (int b = 0; b < this->blocks.size(); b++)
+        {
+            Block &block = this->blocks[b];
+            Quad last = block.last == -1 ? Quad("") : this->last(block);
+            if (last.is_jump())
+                block.succs.push_back(this->label_block[last.arg]);
+            if (last.op != "JMP" && !last.is_return() && b + 1 < this->blocks.size())
+                block.succs.push_back(b + 1);
+            for (int s : block.succs)
+                this->blocks[s].preds.push_back(b);
+        }
+    }
+
+    void compute_func_refs()
+    {
+        map<string, set<string>> calls;
+        for (int i = 0; i < this->quads.size(); i++)
+        {
+            Quad &q = this->quads[i];
+            if (q.op == "DEF")
+                this->func_refs[q.arg];
+            // Nested functions count as part of their enclosing functions.
+            for (string f = this->blocks[this->block_of[i]].func; f != ""; f = this->enclosing_func(f))
+            {
+                if (q.is_load() || q.is_store())
+                    this->func_refs[f].insert(q.arg);
+                else if (q.is_call())
+                    calls[f].insert(q.arg);
+            }
+        }
+
+        // Propagate the references (and calls) of callees into their callers until nothing changes.
+        // Callees go first, so it only takes another round when functions call each other (through nested ones).
+        vector<string> order;
+        set<string> visited;
+        for (auto &ref : this->func_refs)
+            order_callees_first(ref.first, calls, visited, order);
+        for (bool changed = true; changed;)
+        {
+            changed = false;
+            for (string caller : order)
+                for (string callee : set<string>(calls[caller]))
+                {
+                    for (string var : this->func_refs[callee])
+                        changed |= this->func_refs[caller].insert(var).second;
+                    for (string indirect : calls[callee])
+                        changed |= calls[caller].insert(indirect).second;
+                }
+        }
+        this->func_calls = calls;
+
+        // Whatever is referenced only inside a function can't be observed by its callers.
+        // Unless it is recursive, in which case the caller is the function itself.
+        for (auto &ref : this->func_refs)
+        {
+            set<string> &escaping = this->func_escaping[ref.first];
+            for (int i = 0; i < this->quads.size(); i++)
+                if ((this->quads[i].is_load() || this->quads[i].is_store()) && !this->inside_func(i, ref.first))
+                    escaping.insert(this->quads[i].arg);
+            if (this->is_recursive(ref.first))
+                escaping.insert(ref.second.begin(), ref.second.end());
+        }
+    }
+
+    // The variables referenced inside a function's body that can't be observed outside of it.
+    // What a function reads before writing (on some path) is left over from its previous invocations,
+    // which observe it that way, so the liveness has to be computed to exclude those.
+    set<string> private_vars(string func)
+    {
+        set<string> inside, outside, vars;
+        for (int i = 0; i < this->quads.size(); i++)
+            if (this->quads[i].is_load() || this->quads[i].is_store())
+                (this->inside_func(i, func) ? inside : outside).insert(this->quads[i].arg);
+        set<string> &entry = this->blocks[this->label_block[func]].live_in;
+        for (string var : inside)
+            if (!outside.count(var) && !entry.count(var))
+                vars.insert(var);
+        return vars;
+    }
+
+    bool is_recursive(string func)
+    {
+        return this->func_calls[func].count(func);
+    }
+
+    // The variables that each invocation of a recursive function needs its own copy of: the ones declared
+    // inside it and the ones the optimizer made up for its body. They are saved when it is called and
+    // restored when it returns. Other functions have none.
+    set<string> frame_vars(string func)
+    {
+        set<string> own, outside, vars;
+        if (!this->is_recursive(func))
+            return vars;
+        for (int i = 0; i < this->quads.size(); i++)
+            if (this->quads[i].is_load() || this->quads[i].is_store())
+            {
+                if (this->blocks[this->block_of[i]].func == func)
+                    own.insert(this->quads[i].arg);
+                else if (!this->inside_func(i, func))
+                    outside.insert(this->quads[i].arg);
+            }
+        for (string var : own)
+            if (func_locals[func].count(var) || (var.rfind("v_", 0) != 0 && !outside.count(var)))
+                vars.insert(var);
+        return vars;
+    }
+
+    // The function that the definition of `func` is nested in, empty for top level functions.
+    string enclosing_func(string func)
+    {
+        int def = this->blocks[this->label_block[func]].start;
+        return def == 0 ? "" : this->blocks[this->block_of[def - 1]].func;
+    }
+
+    // Whether the quad at `index` lies inside the body of `func` (or a function nested in it).
+    bool inside_func(int index, string func)
+    {
+        for (string f = this->blocks[this->block_of[index]].func; f != ""; f = this->enclosing_func(f))
+            if (f == func)
+                return true;
+        return false;
+    }
+
+    // Marks the blocks reachable from the start of the program, following calls into functions.
+    void compute_reachability()
+    {
+        if (this->blocks.empty())
+            return;
+        vector<int> worklist = {0};
+        this->blocks[0].reachable = true;
+        while (!worklist.empty())
+        {
+            Block &block = this->blocks[worklist.back()];
+            worklist.pop_back();
+            vector<int> next = block.succs;
+            for (int i = block.start; i < block.end; i++)
+                if (this->quads[i].is_call() && this->label_block.count(this->quads[i].arg))
+                    next.push_back(this->label_block[this->quads[i].arg]);
+            for (int n : next)
+                if (!this->blocks[n].reachable)
+                {
+                    this->blocks[n].reachable = true;
+                    worklist.push_back(n);
+                }
+        }
+    }
+
+    // Updates `live` (the variables live after `q`) to the variables live before it.
+    void transfer(Quad &q, string func, set<string> &live)
+    {
+        if (q.is_store())
+            live.erase(q.arg);
+        else if (q.is_load())
+            live.insert(q.arg);
+        if (q.is_call())
+            live.insert(this->func_refs[q.arg].begin(), this->func_refs[q.arg].end());
+        if (q.is_return() && func != "")
+            live.insert(this->func_escaping[func].begin(), this->func_escaping[func].end());
+    }
+
+    // Classic backward liveness analysis over the blocks.
+    void compute_liveness()
+    {
+        for (bool changed = true; changed;)
+        {
+            changed = false;
+            for (int b = this->blocks.size() - 1; b >= 0; b--)
+            {
+                Block &block = this->blocks[b];
+                set<string> live;
+                for (int s : block.succs)
+                    live.insert(this->blocks[s].live_in.begin(), this->blocks[s].live_in.end());
+                // What a function reads before writing survives from its previous invocation.
+                if (block.last != -1 && this->last(block).is_return() && block.func != "")
+                {
+                    set<string> &entry = this->blocks[this->label_block[block.func]].live_in;
+                    live.insert(entry.begin(), entry.end());
+                }
+                block.live_out = live;
+                for (int i = block.end - 1; i >= block.start; i--)
+                    this->transfer(this->quads[i], block.func, live);
+                if (live != block.live_in)
+                {
+                    block.live_in = live;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // Entry blocks are the start of the program and the start of every function.
+    bool is_entry(int b)
+    {
+        return b == 0 || this->quads[this->blocks[b].start].op == "DEF";
+    }
+
+    void compute_dominators()
+    {
+        set<int> all;
+        for (int b = 0; b < this->blocks.size(); b++)
+            all.insert(b);
+        for (int b = 0; b < this->blocks.size(); b++)
+            this->blocks[b].dominators = this->is_entry(b) ? set<int>{b} : all;
+        for (bool changed = true; changed;)
+        {
+            changed = false;
+            for (int b = 0; b < this->blocks.size(); b++)
+            {
+                Block &block = this->blocks[b];
+                if (this->is_entry(b) || !block.reachable)
+                    continue;
+                set<int> dominators = all;
+                for (int p : block.preds)
+                {
+                    if (!this->blocks[p].reachable)
+                        continue;
+                    set<int> common;
+                    for (int d : this->blocks[p].dominators)
+                        if (dominators.count(d))
+                            common.insert(d);
+                    dominators = common;
+                }
+                dominators.insert(b);
+                if (dominators != block.dominators)
+                {
+                    block.dominators = dominators;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // Finds the loops out of the back edges: the jumps to a block that dominates the jumping block.
+    // Loops sharing a header are merged into one.
+    vector<Loop> find_loops()
+    {
+        this->compute_dominators();
+        map<int, set<int>> loops;
+        for (int b = 0; b < this->blocks.size(); b++)
+            for (int h : this->blocks[b].succs)
+                if (this->blocks[b].reachable && this->blocks[b].dominators.count(h))
+                {
+                    // The loop is the header plus whatever reaches the back edge without going through the header.
+                    set<int> &body = loops[h];
+                    body.insert(h);
+                    vector<int> worklist = {b};
+                    while (!worklist.empty())
+                    {
+                        int n = worklist.back();
+                        worklist.pop_back();
+                        if (body.insert(n).second)
+                            for (int p : this->blocks[n].preds)
+                                worklist.push_back(p);
+                    }
+                }
+        vector<Loop> result;
+        for (auto &loop : loops)
+            result.push_back(Loop{loop.first, loop.second});
+        return result;
+    }
+
+    // Forward analysis of the variables that surely have a value (the VM refuses to read the others).
+    void compute_assigned()
+    {
+        vector<bool> visited(this->blocks.size(), false);
+        for (bool changed = true; changed;)
+        {
+            changed = false;
+            for (int b = 0; b < this->blocks.size(); b++)
+            {
+                Block &block = this->blocks[b];
+                set<string> assigned;
+                bool first = true;
+                for (int p : block.preds)
+                    if (visited[p] && !this->is_entry(b))
+                    {
+                        if (first)
+                            assigned = this->blocks[p].assigned_out;
+                        else
+                            for (auto it = assigned.begin(); it != assigned.end();)
+                                it = this->blocks[p].assigned_out.count(*it) ? next(it) : assigned.erase(it);
+                        first = false;
+                    }
+                if (!block.reachable || (first && !this->is_entry(b)))
+                    continue;
+                for (int i = block.start; i < block.end; i++)
+                    if (this->quads[i].is_store())
+                        assigned.insert(this->quads[i].arg);
+                if (!visited[b] || assigned != block.assigned_out)
+                {
+                    visited[b] = true;
+                    block.assigned_out = assigned;
+                    changed = true;
+                }
+            }
+        }
+    }
+};
@@ -0,0 +1,107 @@
+// This file contains the static analysis of the stack frames, run on the final quads of the program.
+// The frame of a function holds its arguments and whatever it pushes on top of them, the frame of the
+// top level program holds everything else. Their sizes head the quad file in FRAME lines, so that the VM
+// can preallocate its stacks and only check for overflows when calling a function.
+#include "cfg.hpp"
+
+// What the analysis finds out about a function, or about the top level program (named `main`).
+struct Frame
+{
+    string name;
+    // The number of arguments the caller leaves on the stack.
+    int params;
+    // The maximum depth of the operand stack, counting the arguments.
+    int stack;
+    // The number of variables the body reads or writes.
+    int locals;
+    // The variables saved on every call and restored on return, for recursive functions.
+    set<string> saved;
+
+    string str()
+    {
+        string line = format("FRAME %s %d %d %d", this->name.c_str(), this->params, this->stack, this->locals);
+        for (string var : this->saved)
+            line += " " + var;
+        return line;
+    }
+};
+
+// Stack imbalances are compiler bugs that would leak (or underflow) the VM's stack at runtime.
+#define stack_error(frame, msg)                                                                     \
+    {                                                                                               \
+        cerr << "SEM-E(" << (frame.name == "main" ? "top level" : frame.name) << "): " << msg << endl; \
+        abort();                                                                                    \
+    }
+
+// Follows the paths of `func` (empty for the top level program) keeping track of the stack depth, which
+// has to be the same whichever path reaches an instruction.
+Frame analyze_frame(Cfg &cfg, string func)
+{
+    Frame frame;
+    frame.name = func == "" ? "main" : func;
+    frame.params = func == "" ? 0 : func_arity[func];
+    frame.stack = frame.params;
+    frame.saved = func == "" ? set<string>() : cfg.frame_vars(func);
+    set<string> vars;
+    if (cfg.blocks.empty())
+    {
+        frame.locals = 0;
+        return frame;
+    }
+
+    int entry = func == "" ? 0 : cfg.label_block[func];
+    map<int, int> depth_in = {{entry, frame.params}};
+    vector<int> worklist = {entry};
+    while (!worklist.empty())
+    {
+        int b = worklist.back();
+        worklist.pop_back();
+        Block &block = cfg.blocks[b];
+        int depth = depth_in[b];
+        for (int i = block.start; i < block.end; i++)
+        {
+            Quad &q = cfg.quads[i];
+            if (q.is_load() || q.is_store())
+                vars.insert(q.arg);
+            int pops, pushes;
+            stack_effect(q, pops, pushes);
+            if (depth < pops)
+                stack_error(frame, format("'%s' pops more values than there are on the stack.", q.str().c_str() + 1));
+            depth += pushes - pops;
+            frame.stack = max(frame.stack, depth);
+            if (q.is_return() && depth != 0)
+                stack_error(frame, format("%d value(s) are left on the stack by '%s'.", depth, q.str().c_str() + 1));
+        }
+        // The end of the program has to leave the stack empty as well.
+        if (block.succs.empty() && depth != 0 && (block.last == -1 || !cfg.last(block).is_return()))
+            stack_error(frame, format("%d value(s) are left on the stack at the end of the program.", depth));
+        for (int s : block.succs)
+            if (!depth_in.count(s))
+            {
+                depth_in[s] = depth;
+                worklist.push_back(s);
+            }
+            else if (depth_in[s] != depth)
+                stack_error(frame, format("The paths reaching '%s' leave %d and %d value(s) on the stack.", cfg.quads[cfg.blocks[s].start].str().c_str(), depth_in[s], depth));
+    }
+    frame.locals = vars.size();
+    return frame;
+}
+
+// Analyzes the frames of the quad file at `path` and writes them at its head, replacing the old ones.
+void record_frames(string path)
+{
+    vector<Quad> quads, code = read_quads(path);
+    for (Quad &q : code)
+        if (q.op != "FRAME")
+            quads.push_back(q);
+    compute_func_arity(quads);
+    Cfg cfg(quads);
+
+    vector<Quad> header = {Quad(analyze_frame(cfg, "").str())};
+    for (Quad &q : quads)
+        if (q.op == "DEF")
+            header.push_back(Quad(analyze_frame(cfg, q.arg).str()));
+    quads.insert(quads.begin(), header.begin(), header.end());
+    write_quads(path, quads);
+}
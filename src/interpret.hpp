@@ -0,0 +1,313 @@
+// This file contains a quad interpreter that runs calls to pure functions at compile time.
+// It mirrors the VM in methanol.py, so it computes exactly what the VM would at runtime.
+#include <climits>
+#include "cfg.hpp"
+
+// The type of an immediate value, the way the VM would interpret it.
+yytokentype immediate_type(string imm)
+{
+    if (imm[0] == '"')
+        return STRING;
+    if (imm == "true" || imm == "false")
+        return LOGICAL;
+    if (imm.find('.') != string::npos)
+        return DOUBLE;
+    return INTEGER;
+}
+
+Expression *to_expression(string imm)
+{
+    yytokentype type = immediate_type(imm);
+    if (type == STRING)
+        return new Expression(STRING, true, Value((char *)imm.substr(1, imm.size() - 2).c_str()));
+    if (type == LOGICAL)
+        return new Expression(LOGICAL, true, Value(imm == "true"));
+    if (type == DOUBLE)
+        return new Expression(DOUBLE, true, Value(atof(imm.c_str())));
+    return new Expression(INTEGER, true, Value(atoi(imm.c_str())));
+}
+
+// Writes back the value of a folded expression as an immediate, returns false if it can't be written exactly.
+bool from_expression(Expression *expr, string &imm)
+{
+    if (expr->type == LOGICAL)
+        imm = expr->value.logical ? "true" : "false";
+    else if (expr->type == INTEGER)
+        imm = to_string(expr->value.integer);
+    else if (expr->type == DOUBLE)
+    {
+        // Enough digits to read back the very same double, and a '.' so the VM reads it as one.
+        imm = format("%.17g", expr->value.real);
+        if (imm.find_first_of("einf") != string::npos)
+            return false;
+        if (imm.find('.') == string::npos)
+            imm += ".0";
+    }
+    else
+        return false;
+    return true;
+}
+
+// Whether the VM considers a value false (mirrors Python's truthiness).
+bool is_falsy(string imm)
+{
+    yytokentype type = immediate_type(imm);
+    if (type == STRING)
+        return imm == "\"\"";
+    if (type == LOGICAL)
+        return imm == "false";
+    return atof(imm.c_str()) == 0.0;
+}
+
+yytokentype quad_operation(string op)
+{
+    map<string, yytokentype> ops = {{"PLUS", PLUS}, {"MINUS", MINUS}, {"MULT", MULT}, {"DIV", DIV}, {"LT", LT}, {"GT", GT}, {"LTEQ", LTE}, {"GTEQ", GTE}, {"EQ", EQ}, {"NEQ", NE}};
+    return ops.count(op) ? ops[op] : ERROR;
+}
+
+// Computes `first op second` on immediates at compile time, the same way the VM would at runtime.
+// Returns false if the result can't be known (or would differ from the VM's), like a division by zero.
+bool fold_binary(string first, string second, string op, string &result)
+{
+    yytokentype a = immediate_type(first), b = immediate_type(second);
+    // The VM returns one of the operands for these.
+    if (op == "AND" || op == "OR")
+    {
+        if ((a != LOGICAL && a != INTEGER) || (b != LOGICAL && b != INTEGER))
+            return false;
+        result = is_falsy(second) == (op == "AND") ? second : first;
+        return true;
+    }
+
+    yytokentype oper = quad_operation(op);
+    bool arithmetic = oper == PLUS || oper == MINUS || oper == MULT || oper == DIV;
+    // Operands have been converted to the same type by now, anything else is left to the VM.
+    if (oper == ERROR || a != b || a == LOGICAL || (a == STRING && arithmetic))
+        return false;
+    if (a == STRING && oper != EQ && oper != NE)
+        return false;
+    if (oper == DIV && atof(second.c_str()) == 0.0)
+        return false;
+    if (a == INTEGER && arithmetic)
+    {
+        // The VM has arbitrary precision integers and floors its divisions.
+        long long x = atoll(first.c_str()), y = atoll(second.c_str());
+        long long exact = oper == PLUS ? x + y : oper == MINUS ? x - y : oper == MULT ? x * y : x / y;
+        if (exact != (int)exact || (oper == DIV && x % y != 0 && (x < 0) != (y < 0)))
+            return false;
+    }
+    return from_expression(to_expression(first)->oper(to_expression(second), oper), result);
+}
+
+bool fold_unary(string operand, string op, string &result)
+{
+    yytokentype type = immediate_type(operand);
+    if (op == "NOT" && type != STRING)
+        result = is_falsy(operand) ? "true" : "false";
+    else if (op == "NEG" && (type == INTEGER || type == DOUBLE))
+        return operand != to_string(INT_MIN) && from_expression(to_expression(operand)->neg(), result);
+    else if (op == "INT2REAL" && type == INTEGER)
+        return from_expression(new Expression(DOUBLE, true, Value(atof(operand.c_str()))), result);
+    else if (op == "REAL2INT" && type == DOUBLE && abs(atof(operand.c_str())) < INT_MAX)
+        return from_expression(new Expression(INTEGER, true, Value((int)atof(operand.c_str()))), result);
+    else
+        return false;
+    return true;
+}
+
+// Calls taking more steps (in quads) than this are left for the VM to run.
+#define MAX_EVALUATION_STEPS 100000
+
+// Runs calls to the functions of a program like the VM would. Where the labels are and which variables each
+// function may write are found once for the program, and shared by all the calls.
+struct Evaluator
+{
+    vector<Quad> &quads;
+    Cfg &cfg;
+    map<string, int> labels;
+    // The variables a call to each function may write, found when it is first called.
+    map<string, set<string>> writable;
+    // The variables each function saves when called, see Cfg::frame_vars.
+    map<string, set<string>> frames;
+    // Variables referenced by quads that the control-flow graph doesn't cover (emitted after it was built).
+    set<string> observed;
+
+    // The liveness of `cfg` has to be computed.
+    Evaluator(vector<Quad> &quads, Cfg &cfg) : quads(quads), cfg(cfg)
+    {
+        for (int i = 0; i < quads.size(); i++)
+            if (quads[i].is_label())
+                this->labels[quads[i].arg] = i;
+    }
+
+    // The variables that no one outside `func` (or its callees) can observe.
+    set<string> &writable_vars(string func)
+    {
+        if (!this->writable.count(func))
+        {
+            set<string> &vars = this->writable[func] = this->cfg.private_vars(func);
+            for (string callee : this->cfg.func_calls[func])
+            {
+                set<string> private_vars = this->cfg.private_vars(callee);
+                vars.insert(private_vars.begin(), private_vars.end());
+            }
+        }
+        return this->writable[func];
+    }
+
+    // Saves the variables of `func`'s frame into `saved`, keeping the ones already there. Unset variables
+    // are saved as "" so that restoring them unsets them again.
+    void save_frame(string func, map<string, string> &variables, map<string, string> &saved)
+    {
+        if (!this->frames.count(func))
+            this->frames[func] = this->cfg.frame_vars(func);
+        for (string var : this->frames[func])
+            saved.insert({var, variables.count(var) ? variables[var] : ""});
+    }
+
+    void restore_frame(map<string, string> &variables, map<string, string> &saved)
+    {
+        for (auto &var : saved)
+            if (var.second == "")
+                variables.erase(var.first);
+            else
+                variables[var.first] = var.second;
+    }
+
+    // Runs `func` on the given arguments and leaves the returned value in `result`.
+    // The function has to be pure: it can't print, it can't read what it didn't write itself (or got as
+    // arguments) and it can only write to the variables that no one outside it (or its callees) can observe.
+    // Returns false if the call isn't pure, fails (e.g. divides by zero) or takes too many steps.
+    bool evaluate_call(string func, vector<string> args, string &result)
+    {
+        if (!this->cfg.label_block.count(func))
+            return false;
+        set<string> &writable = this->writable_vars(func);
+        vector<string> stack = args;
+        vector<int> returns;
+        // What each call in `returns` saved, see save_frame.
+        vector<map<string, string>> saves;
+        map<string, string> variables;
+        int index = this->labels[func];
+        for (int steps = 0; steps < MAX_EVALUATION_STEPS; steps++, index++)
+        {
+            if (index >= this->quads.size())
+                return false;
+            Quad &q = this->quads[index];
+            string value;
+            if (!q.is_code() || q.is_label())
+                continue;
+            int pops, pushes;
+            stack_effect(q, pops, pushes);
+            if (stack.size() < pops)
+                return false;
+
+            if (q.op == "PUSH")
+            {
+                if (q.is_load() && !variables.count(q.arg))
+                    return false;
+                stack.push_back(q.is_load() ? variables[q.arg] : q.arg);
+            }
+            else if (q.is_store())
+            {
+                if (!writable.count(q.arg) || this->observed.count(q.arg))
+                    return false;
+                variables[q.arg] = stack.back();
+                stack.pop_back();
+            }
+            else if (q.op == "POP")
+                stack.pop_back();
+            else if (q.op == "DUP")
+                stack.push_back(stack.back());
+            else if (q.op == "JMP" || q.op == "JZ" || q.is_call())
+            {
+                // A jump to a label that doesn't exist (yet, while parsing) can't be followed.
+                auto label = this->labels.find(q.arg);
+                if (label == this->labels.end())
+                    return false;
+                if (q.op == "JZ")
+                {
+                    value = stack.back();
+                    stack.pop_back();
+                    if (immediate_type(value) == STRING || !is_falsy(value))
+                        continue;
+                }
+                // Like the VM, a TAILCALL adds what the callee saves to what the current call saved.
+                if (q.op == "CALL")
+                {
+                    returns.push_back(index);
+                    saves.push_back(map<string, string>());
+                }
+                if (q.is_call() && !saves.empty())
+                    this->save_frame(q.arg, variables, saves.back());
+                index = label->second;
+            }
+            else if (q.op == "RET")
+            {
+                if (returns.empty())
+                {
+                    result = stack.back();
+                    return true;
+                }
+                index = returns.back();
+                returns.pop_back();
+                this->restore_frame(variables, saves.back());
+                saves.pop_back();
+            }
+            else if (pops == 1 && pushes == 1 && fold_unary(stack.back(), q.op, value))
+                stack.back() = value;
+            else if (pops == 2 && pushes == 1 && fold_binary(stack[stack.size() - 2], stack.back(), q.op, value))
+            {
+                stack.pop_back();
+                stack.back() = value;
+            }
+            else
+                return false; // PRINT, OPAQUE, or an operation the VM would fail at.
+        }
+        return false;
+    }
+};
+
+// The calls made while parsing are evaluated over the quads emitted so far. The control-flow graph is only
+// rebuilt once a function definition starts or ends, the quads emitted in between are just scanned for the
+// variables they reference and kept aside, since the graph (and everything cached from it) only covers
+// `parsed_quads`.
+vector<Quad> parsed_quads, pending_quads;
+Cfg *parsed_cfg = nullptr;
+Evaluator *parsed_evaluator = nullptr;
+long parsed_length = 0;
+
+bool evaluate_call(string func, vector<string> args, string &result)
+{
+    quadout.flush();
+    ifstream in(fout + ".quad");
+    in.seekg(parsed_length);
+    parsed_length = quadout.tellp();
+    vector<Quad> added;
+    bool rebuild = parsed_evaluator == nullptr;
+    string line;
+    while (getline(in, line))
+    {
+        Quad q(line);
+        rebuild |= q.op == "DEF" || (q.op == "LABEL" && q.arg.rfind("fend_", 0) == 0);
+        added.push_back(q);
+    }
+    pending_quads.insert(pending_quads.end(), added.begin(), added.end());
+
+    if (rebuild)
+    {
+        parsed_quads.insert(parsed_quads.end(), pending_quads.begin(), pending_quads.end());
+        pending_quads.clear();
+        delete parsed_evaluator;
+        delete parsed_cfg;
+        compute_func_arity(parsed_quads);
+        parsed_cfg = new Cfg(parsed_quads);
+        parsed_cfg->compute_liveness();
+        parsed_evaluator = new Evaluator(parsed_quads, *parsed_cfg);
+    }
+    else
+        for (Quad &q : added)
+            if (q.is_load() || q.is_store())
+                parsed_evaluator->observed.insert(q.arg);
+    return parsed_evaluator->evaluate_call(func, args, result);
+}
@@ -4,6 +4,7 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
 #include "quads.hpp"
 #include "parse.tab.hpp"
 using namespace std;
@@ -67,6 +68,28 @@ struct StringList
     }
 };
 
+struct ExpressionList
+{
+    vector<struct Expression *> list;
+
+    ExpressionList(struct Expression *item)
+    {
+        this->append(item);
+    }
+
+    ExpressionList()
+    {
+    }
+
+    ExpressionList *append(struct Expression *item)
+    {
+        list.push_back(item);
+        return this;
+    }
+
+    vector<yytokentype> types();
+};
+
 struct TypeList
 {
     vector<yytokentype> list;
@@ -116,6 +139,10 @@ const char *token_name(yytokentype type)
         return "a string";
     case ENUM_TYPE_DECLARATION:
         return "an enum";
+    case INTEGER_ARRAY:
+        return "an integer array";
+    case DOUBLE_ARRAY:
+        return "a float array";
     /* Operations */
     case PLUS:
         return "addition";
@@ -146,6 +173,20 @@ const char *token_name(yytokentype type)
     }
 }
 
+// Arrays hold numbers of a single type, stored contiguously.
+bool is_array_type(yytokentype type)
+{
+    return type == INTEGER_ARRAY || type == DOUBLE_ARRAY;
+}
+yytokentype element_type(yytokentype array)
+{
+    return array == INTEGER_ARRAY ? INTEGER : DOUBLE;
+}
+yytokentype array_type(yytokentype element)
+{
+    return element == INTEGER ? INTEGER_ARRAY : DOUBLE_ARRAY;
+}
+
 // The computed value of an expression.
 union Value
 {
@@ -231,13 +272,18 @@ struct Expression
         return type == ENUM_TYPE_DECLARATION;
     }
 
+    bool is_array()
+    {
+        return is_array_type(type);
+    }
+
     Expression *neg()
     {
         if (type == INTEGER)
             this->value.integer = -this->value.integer;
         else if (type == DOUBLE)
             this->value.real = -this->value.real;
-        else
+        else if (!this->is_array())
             semantic_error(format("Cannot negate %s.", token_name(type)));
         return this;
     }
@@ -253,6 +299,8 @@ struct Expression
 
     Expression *oper(Expression *other, yytokentype op)
     {
+        if (this->is_array() || other->is_array())
+            return this->array_oper(other, op);
         // If both expressions are constants, we can compute the result.
         // Otherwise, the result is garbage.
         this->is_const &= other->is_const;
@@ -438,8 +486,33 @@ struct Expression
             semantic_error(format("Operation %s cannot be performed between %s and %s.", token_name(op), token_name(this->type), token_name(other->type)));
         return this;
     }
+
+    // Arrays are operated on element-wise, along with arrays of the same type or numbers of their element type.
+    // Note: There are no conversions between integer and float arrays.
+    Expression *array_oper(Expression *other, yytokentype op)
+    {
+        yytokentype array = this->is_array() ? this->type : other->type;
+        bool compatible = (this->type == array || this->type == element_type(array)) && (other->type == array || other->type == element_type(array));
+        if (!compatible || op == AND || op == OR)
+            semantic_error(format("Operation %s cannot be performed between %s and %s.", token_name(op), token_name(this->type), token_name(other->type)));
+        this->is_const = false;
+        // Comparisons give an integer array of ones where they hold and zeros where they don't.
+        if (op == PLUS || op == MINUS || op == MULT || op == DIV)
+            this->type = array;
+        else
+            this->type = INTEGER_ARRAY;
+        return this;
+    }
 };
 
+vector<yytokentype> ExpressionList::types()
+{
+    vector<yytokentype> types;
+    for (Expression *expr : this->list)
+        types.push_back(expr->type);
+    return types;
+}
+
 // A class for the variables and functions of our program.
 struct Identifier
 {
@@ -618,9 +691,14 @@ Expression *get_expr_for_variable(string name)
     return id->get_expr();
 }
 
-Expression *get_expr_for_func_invocation(string name, struct TypeList *args)
+// Defined in interpret.hpp.
+bool evaluate_call(string func, vector<string> args, string &result);
+bool from_expression(Expression *expr, string &imm);
+bool is_falsy(string imm);
+
+Expression *get_expr_for_func_invocation(string name, struct ExpressionList *args)
 {
-    vector<yytokentype> arg_types = args->list;
+    vector<yytokentype> arg_types = args->types();
     Identifier *id = get_ident(name, "Function");
 
     if (id->func_params.size() != arg_types.size())
@@ -631,7 +709,26 @@ Expression *get_expr_for_func_invocation(string name, struct TypeList *args)
             semantic_error(format("Argument N#%d of function '%s' is %s, but %s was provided.", i + 1, name.c_str(), token_name(id->func_params[i]), token_name(arg_types[i])));
 
     id->is_used = true;
-    return id->get_expr();
+
+    // A pure function called with constant arguments has a compile-time known value.
+    vector<string> arg_values;
+    for (Expression *arg : args->list)
+    {
+        string value;
+        if (!arg->is_const || !from_expression(arg, value))
+            return id->get_expr();
+        arg_values.push_back(value);
+    }
+    string result;
+    if (!evaluate_call(format("f_%s%d", name.c_str(), get_scope(name)), arg_values, result))
+        return id->get_expr();
+    if (id->type == INTEGER)
+        return new Expression(INTEGER, true, Value(atoi(result.c_str())));
+    else if (id->type == DOUBLE)
+        return new Expression(DOUBLE, true, Value(atof(result.c_str())));
+    else if (id->type == LOGICAL)
+        return new Expression(LOGICAL, true, Value(!is_falsy(result)));
+    return new Expression(STRING, true, Value((char *)result.substr(1, result.size() - 2).c_str()));
 }
 
 void assign_expr_to_variable(Expression *expr, string name)
@@ -666,11 +763,119 @@ void assign_expr_to_variable(Expression *expr, string name)
     id->value = expr->value;
 }
 
+// The array variable `name`, making sure it is one.
+Identifier *get_array_ident(string name, Expression *index)
+{
+    Identifier *id = get_ident(name, "Variable");
+    if (!is_array_type(id->type))
+        semantic_error(format("'%s' is %s, it can't be indexed.", name.c_str(), token_name(id->type)));
+    if (index->type != INTEGER)
+        semantic_error(format("Array indices must be integers, got %s.", token_name(index->type)));
+    return id;
+}
+
+Expression *get_expr_for_element(string name, Expression *index)
+{
+    Identifier *id = get_array_ident(name, index);
+    get_expr_for_variable(name);
+    q_pushv(name);
+    q_vget();
+    return new Expression(element_type(id->type), false, Value());
+}
+
+void assign_expr_to_element(string name, Expression *index, Expression *expr)
+{
+    Identifier *id = get_array_ident(name, index);
+    get_expr_for_variable(name);
+    // Like variables, elements can be assigned numbers of the other type.
+    if (!expr->is_num())
+        semantic_error(format("An element of '%s' can't be assigned %s.", name.c_str(), token_name(expr->type)));
+    if (expr->type != element_type(id->type))
+        element_type(id->type) == DOUBLE ? q_int2real() : q_real2int();
+    q_pushv(name);
+    q_vset();
+}
+
+Expression *get_expr_for_array_literal(struct ExpressionList *elements)
+{
+    vector<yytokentype> types = elements->types();
+    if (types.empty())
+        semantic_error("An empty array has no type, use fill(0, 0) or fill(0.0, 0) instead.");
+    for (yytokentype type : types)
+        if ((type != INTEGER && type != DOUBLE) || type != types[0])
+            semantic_error(format("Array elements must be all integers or all floats, got %s and %s.", token_name(types[0]), token_name(type)));
+    q_array(types.size());
+    return new Expression(array_type(types[0]), false, Value());
+}
+
+// The functions that come with the language, unless the program declares its own with the same names.
+bool is_builtin_func(string name)
+{
+    return get_scope(name) == -1 && (name == "len" || name == "sum" || name == "min" || name == "max" || name == "fill" || name == "copy" ||
+        name == "opaque");
+}
+
+Expression *get_expr_for_builtin_invocation(string name, struct ExpressionList *args)
+{
+    vector<yytokentype> types = args->types();
+    // opaque(value) is `value`, except that the optimizer can't tell what it is and has to leave it to the VM.
+    if (name == "opaque")
+    {
+        if (types.size() != 1)
+            semantic_error("Function 'opaque' expects a single argument.");
+        q_opaque();
+        return new Expression(types[0], false, Value());
+    }
+    // fill(value, length) creates an array of `length` copies of `value`.
+    if (name == "fill")
+    {
+        if (types.size() != 2 || (types[0] != INTEGER && types[0] != DOUBLE) || types[1] != INTEGER)
+            semantic_error("Function 'fill' expects a number to fill the array with and an integer length.");
+        q_fill();
+        return new Expression(array_type(types[0]), false, Value());
+    }
+    if (types.size() != 1 || !is_array_type(types[0]))
+        semantic_error(format("Function '%s' expects a single array argument.", name.c_str()));
+    if (name == "len")
+    {
+        q_vlen();
+        return new Expression(INTEGER, false, Value());
+    }
+    if (name == "copy")
+    {
+        q_copy();
+        return new Expression(types[0], false, Value());
+    }
+    if (name == "sum")
+        q_vsum();
+    else if (name == "min")
+        q_vmin();
+    else
+        q_vmax();
+    return new Expression(element_type(types[0]), false, Value());
+}
+
+// The labels of the functions being defined, innermost last.
+vector<string> func_labels;
+// The variables declared inside each function (by its label), parameters included.
+map<string, set<string>> func_locals;
+
 void declare_identifier(Identifier *id)
 {
     if (symtable[current_scope].find(id->name) != symtable[current_scope].end())
         semantic_error(format("Identifier '%s' has already been declared in this scope in L#%d.", id->name.c_str(), symtable[current_scope][id->name]->line));
     symtable[current_scope][id->name] = id;
+    if (!func_labels.empty() && !id->is_func && !id->is_enum_type)
+        func_locals[func_labels.back()].insert(format("v_%s%d", id->name.c_str(), current_scope));
+}
+
+// Declares a function in the scope enclosing its parameters, which is entered before they are parsed.
+void declare_func_identifier(Identifier *id)
+{
+    current_scope--;
+    id->scope = current_scope;
+    declare_identifier(id);
+    current_scope++;
 }
 
 string check_and_get_static_enum_code(string enum_type, string enum_variant)
@@ -687,9 +892,13 @@ string check_and_get_static_enum_code(string enum_type, string enum_variant)
 
 // Stores a stack of function return types to check them against return statements.
 vector<pair<yytokentype, bool>> func_return_types_stack;
-void push_func_ret_type(yytokentype type)
+// And how many switch statements were open when each function started.
+vector<int> func_switch_depths;
+void push_func_ret_type(yytokentype type, string label)
 {
     func_return_types_stack.push_back({type, false});
+    func_switch_depths.push_back(switch_stack.size());
+    func_labels.push_back(label);
 }
 void validate_return_type(Expression *expr)
 {
@@ -698,10 +907,26 @@ void validate_return_type(Expression *expr)
         semantic_error(format("Return type mismatch. Expected %s, got %s.", token_name(curr_ret_type), token_name(expr->type)));
     func_return_types_stack[func_return_types_stack.size() - 1].second = true;
 }
+// A switch statement keeps the value it switches on in the stack, so returning from inside
+// switch statements has to drop their values from under the returned one first.
+void return_from_func()
+{
+    int switches = switch_stack.size() - func_switch_depths[func_switch_depths.size() - 1];
+    if (switches > 0)
+    {
+        q_popt();
+        while (switches--)
+            q_pop();
+        q_pusht();
+    }
+    q_ret();
+}
 void check_return_included(string name)
 {
     auto top = func_return_types_stack[func_return_types_stack.size() - 1];
     func_return_types_stack.pop_back();
+    func_switch_depths.pop_back();
+    func_labels.pop_back();
     if (top.second == false)
         semantic_warning(format("Function '%s' doesn't return anything.", name.c_str(), token_name(top.first)))
 
@@ -712,6 +937,15 @@ void check_return_included(string name)
         q_push(0.0);
     else if (top.first == STRING)
         q_pushs("");
+    else if (top.first == INTEGER_ARRAY || top.first == DOUBLE_ARRAY)
+    {
+        if (top.first == INTEGER_ARRAY)
+            q_push(0);
+        else
+            q_push(0.0);
+        q_push(0);
+        q_fill();
+    }
     q_ret();
     q_end("function definition");
 }
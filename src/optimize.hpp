@@ -0,0 +1,849 @@
+// This file contains the optimization passes that run over the quads once the whole program has been compiled.
+#include "interpret.hpp"
+
+// Drops the quads marked as removed.
+void sweep(vector<Quad> &quads, vector<bool> &removed)
+{
+    vector<Quad> kept;
+    for (int i = 0; i < quads.size(); i++)
+        if (!removed[i])
+            kept.push_back(quads[i]);
+    quads = kept;
+}
+
+// Removes the blocks that can never execute, like code after a return or functions that are never called.
+bool remove_unreachable(vector<Quad> &quads)
+{
+    Cfg cfg(quads);
+    vector<bool> removed(quads.size(), false);
+    bool changed = false;
+    for (Block &block : cfg.blocks)
+        if (!block.reachable)
+            for (int i = block.start; i < block.end; i++)
+                if (quads[i].is_code())
+                {
+                    removed[i] = true;
+                    changed = true;
+                }
+    sweep(quads, removed);
+    return changed;
+}
+
+// Removes jumps to the very next instruction and the labels that nothing jumps to anymore.
+bool simplify_jumps(vector<Quad> &quads)
+{
+    vector<bool> removed(quads.size(), false);
+    bool changed = false;
+    for (int i = 0; i < quads.size(); i++)
+        if (quads[i].is_jump())
+        {
+            // Look past the labels (and comments) that directly follow the jump.
+            for (int j = i + 1; j < quads.size() && (!quads[j].is_code() || quads[j].op == "LABEL"); j++)
+                if (quads[j].arg == quads[i].arg)
+                {
+                    // A conditional jump still has to consume its condition.
+                    if (quads[i].op == "JZ")
+                        quads[i] = Quad("POP", "");
+                    else
+                        removed[i] = true;
+                    changed = true;
+                    break;
+                }
+        }
+
+    set<string> targets;
+    for (int i = 0; i < quads.size(); i++)
+        if (quads[i].is_jump() && !removed[i])
+            targets.insert(quads[i].arg);
+    for (int i = 0; i < quads.size(); i++)
+        if (quads[i].op == "LABEL" && !targets.count(quads[i].arg))
+        {
+            removed[i] = true;
+            changed = true;
+        }
+    sweep(quads, removed);
+    return changed;
+}
+
+// Finds the first quad of the computation feeding the value consumed at `index`, -1 if that computation
+// doesn't lie entirely in the block or can't be removed because it has side effects.
+// `live` holds the variables live right after `index`.
+int find_pure_producer(vector<Quad> &quads, Block &block, int index, set<string> &live)
+{
+    int needed = 1;
+    for (int i = index - 1; i >= block.start; i--)
+    {
+        Quad &q = quads[i];
+        if (!q.is_code())
+            continue;
+        if (q.is_label() || q.op == "CALL" || q.op == "PRINT" || q.is_array_op())
+            return -1;
+        // Division by zero stops the program, so only a division by a non-zero immediate is side effect free.
+        if (q.op == "DIV")
+        {
+            int j = i - 1;
+            while (j >= block.start && !quads[j].is_code())
+                j--;
+            if (j < block.start || quads[j].op != "PUSH" || !is_immediate(quads[j].arg) || atof(quads[j].arg.c_str()) == 0.0)
+                return -1;
+        }
+        // Stores are fine as long as nobody reads what they store (like the `tmp` used for conversions).
+        if (q.is_store() && live.count(q.arg))
+            return -1;
+        int pops, pushes;
+        stack_effect(q, pops, pushes);
+        // The computation produces more values than the ones consumed at `index`.
+        if (pushes > needed)
+            return -1;
+        needed += pops - pushes;
+        if (needed == 0)
+            return i;
+    }
+    return -1;
+}
+
+// Removes stores to variables that are never read afterwards, along with the computations that only feed them.
+// Computations that call functions are kept for their side effects, only their result gets discarded.
+bool eliminate_dead_stores(vector<Quad> &quads)
+{
+    Cfg cfg(quads);
+    cfg.compute_liveness();
+    vector<bool> removed(quads.size(), false);
+    bool changed = false;
+    for (Block &block : cfg.blocks)
+    {
+        set<string> live = block.live_out;
+        for (int i = block.end - 1; i >= block.start; i--)
+        {
+            Quad &q = quads[i];
+            if (q.op == "POP" && (q.arg == "" || !live.count(q.arg)))
+            {
+                int start = find_pure_producer(quads, block, i, live);
+                if (start != -1)
+                {
+                    for (int j = start; j <= i; j++)
+                        removed[j] = quads[j].is_code();
+                    changed = true;
+                    i = start;
+                    continue;
+                }
+                if (q.arg != "")
+                {
+                    q.arg = "";
+                    changed = true;
+                }
+            }
+            cfg.transfer(q, block.func, live);
+        }
+    }
+    sweep(quads, removed);
+    return changed;
+}
+
+// What is known about a value on the stack: the immediate it equals or the variable it was loaded from
+// (empty if unknown), and the quad that pushed it (-1 if it wasn't pushed by a single quad).
+struct StackValue
+{
+    string value;
+    int producer;
+};
+
+// Forgets what is known about a variable, including the variables known to be copies of it.
+void kill_fact(map<string, string> &facts, vector<StackValue> &stack, string var)
+{
+    facts.erase(var);
+    for (auto it = facts.begin(); it != facts.end();)
+        it = it->second == var ? facts.erase(it) : next(it);
+    for (StackValue &v : stack)
+        if (v.value == var)
+            v.value = "";
+}
+
+// Runs a block over the values known for the variables at its entry, leaving the ones known at its exit.
+// When `removed` is given, loads of known values are replaced by them and operations on immediates are folded.
+void propagate_block(vector<Quad> &quads, Cfg &cfg, Block &block, map<string, string> &facts, vector<bool> *removed)
+{
+    vector<StackValue> stack;
+    auto pop = [&stack]()
+    {
+        if (stack.empty())
+            return StackValue{"", -1}; // Pushed before the block started.
+        StackValue v = stack.back();
+        stack.pop_back();
+        return v;
+    };
+    // Replaces the quad at `index` (and the PUSHes of its operands) with a PUSH of the folded value.
+    auto fold = [&](int index, vector<StackValue> operands, string result)
+    {
+        bool removable = removed != nullptr;
+        for (StackValue &v : operands)
+            removable &= v.producer != -1;
+        if (removable)
+        {
+            for (StackValue &v : operands)
+                (*removed)[v.producer] = true;
+            quads[index] = Quad("PUSH", result);
+        }
+        stack.push_back({result, removable ? index : -1});
+    };
+
+    for (int i = block.start; i < block.end; i++)
+    {
+        Quad &q = quads[i];
+        string result;
+        if (!q.is_code() || q.is_label() || q.op == "JMP")
+            continue;
+        else if (q.op == "PUSH")
+        {
+            string value = q.is_load() && facts.count(q.arg) ? facts[q.arg] : q.arg;
+            if (removed)
+                q.arg = value;
+            stack.push_back({value, i});
+        }
+        else if (q.is_store())
+        {
+            StackValue v = pop();
+            kill_fact(facts, stack, q.arg);
+            if (v.value != "" && v.value != q.arg)
+                facts[q.arg] = v.value;
+        }
+        else if (q.op == "JZ")
+        {
+            StackValue v = pop();
+            // A branch on a known condition is either always or never taken.
+            if (removed && v.producer != -1 && is_immediate(v.value))
+            {
+                (*removed)[v.producer] = true;
+                if (immediate_type(v.value) != STRING && is_falsy(v.value))
+                    q.op = "JMP";
+                else
+                    (*removed)[i] = true;
+            }
+        }
+        else if (q.op == "DUP")
+        {
+            StackValue v = pop();
+            stack.push_back({v.value, -1});
+            stack.push_back({v.value, -1});
+        }
+        else if (q.op == "CALL")
+        {
+            for (int arg = 0; arg < func_arity[q.arg]; arg++)
+                pop();
+            // The callee might write to any of the variables it references.
+            for (string var : cfg.func_refs[q.arg])
+                kill_fact(facts, stack, var);
+            stack.push_back({"", -1});
+        }
+        else
+        {
+            int pops, pushes;
+            stack_effect(q, pops, pushes);
+            vector<StackValue> operands(pops);
+            for (int j = pops - 1; j >= 0; j--)
+                operands[j] = pop();
+            bool known = pushes == 1 && pops > 0;
+            for (StackValue &v : operands)
+                known &= is_immediate(v.value);
+            if (known && pops == 1 && fold_unary(operands[0].value, q.op, result))
+                fold(i, operands, result);
+            else if (known && pops == 2 && fold_binary(operands[0].value, operands[1].value, q.op, result))
+                fold(i, operands, result);
+            else if (pushes == 1)
+                stack.push_back({"", -1});
+        }
+    }
+}
+
+// Keeps only the facts that both agree on.
+void intersect_facts(map<string, string> &facts, map<string, string> &other)
+{
+    for (auto it = facts.begin(); it != facts.end();)
+        it = other.count(it->first) && other[it->first] == it->second ? next(it) : facts.erase(it);
+}
+
+// Forward dataflow analysis of the values known for the variables (constants or copies of other variables),
+// meeting at joins by keeping only what all the predecessors agree on.
+// Loads of known values are then replaced by them and folded into the computations using them.
+bool propagate_constants(vector<Quad> &quads)
+{
+    Cfg cfg(quads);
+    vector<map<string, string>> in(cfg.blocks.size()), out(cfg.blocks.size());
+    vector<bool> visited(cfg.blocks.size(), false);
+    for (bool changed = true; changed;)
+    {
+        changed = false;
+        for (int b = 0; b < cfg.blocks.size(); b++)
+        {
+            Block &block = cfg.blocks[b];
+            // Nothing is known at the start of the program or when a function gets called.
+            bool entry = cfg.is_entry(b);
+            map<string, string> facts;
+            bool first = true;
+            for (int p : block.preds)
+                if (visited[p] && !entry)
+                {
+                    if (first)
+                        facts = out[p];
+                    else
+                        intersect_facts(facts, out[p]);
+                    first = false;
+                }
+            if (!block.reachable || (first && !entry))
+                continue;
+            in[b] = facts;
+            propagate_block(quads, cfg, block, facts, nullptr);
+            // Only ever drop facts, so that copies (which can turn into different copies) don't go back and forth.
+            if (visited[b])
+                intersect_facts(facts, out[b]);
+            if (!visited[b] || facts != out[b])
+            {
+                visited[b] = true;
+                out[b] = facts;
+                changed = true;
+            }
+        }
+    }
+
+    vector<Quad> before = quads;
+    vector<bool> removed(quads.size(), false);
+    for (int b = 0; b < cfg.blocks.size(); b++)
+        if (visited[b])
+            propagate_block(quads, cfg, cfg.blocks[b], in[b], &removed);
+    sweep(quads, removed);
+    if (quads.size() != before.size())
+        return true;
+    for (int i = 0; i < quads.size(); i++)
+        if (quads[i].op != before[i].op || quads[i].arg != before[i].arg)
+            return true;
+    return false;
+}
+
+// Variables made up by the optimizer, they can't clash with the program's `v_` ones.
+int fresh_variables = 0;
+string fresh_variable(string prefix)
+{
+    return prefix + to_string(fresh_variables++);
+}
+
+// The block falling into a loop's header from outside, -1 if the loop can be entered any other way.
+// Code added at its end (right before the header's label) runs once before the loop starts.
+int find_preheader(Cfg &cfg, Loop &loop)
+{
+    int h = loop.header;
+    if (h == 0 || loop.blocks.count(h - 1))
+        return -1;
+    for (int p : cfg.blocks[h].preds)
+        if (!loop.blocks.count(p) && p != h - 1)
+            return -1;
+    Block &pre = cfg.blocks[h - 1];
+    if (pre.last != -1 && (cfg.last(pre).op == "JMP" || cfg.last(pre).is_return()))
+        return -1;
+    return h - 1;
+}
+
+// The variables a loop stores to, including the ones the functions it calls might store to.
+set<string> loop_writes(vector<Quad> &quads, Cfg &cfg, Loop &loop)
+{
+    set<string> writes;
+    for (int b : loop.blocks)
+        for (int i = cfg.blocks[b].start; i < cfg.blocks[b].end; i++)
+            if (quads[i].is_store())
+                writes.insert(quads[i].arg);
+            else if (quads[i].op == "CALL")
+                writes.insert(cfg.func_refs[quads[i].arg].begin(), cfg.func_refs[quads[i].arg].end());
+    return writes;
+}
+
+// Replaces the given quad ranges [start, end) with a PUSH of the matching variable
+// and inserts `code` right before the quad at `before`.
+void rewrite_loop(vector<Quad> &quads, map<int, pair<int, string>> &ranges, int before, vector<Quad> &code)
+{
+    vector<Quad> result;
+    for (int i = 0; i < quads.size(); i++)
+    {
+        if (i == before)
+            result.insert(result.end(), code.begin(), code.end());
+        if (ranges.count(i))
+        {
+            result.push_back(Quad("PUSH", ranges[i].second));
+            i = ranges[i].first - 1;
+        }
+        else
+            result.push_back(quads[i]);
+    }
+    quads = result;
+}
+
+// A value on the stack while looking for loop invariant computations: the quads [start, end) computing it.
+struct Computation
+{
+    int start;
+    int end;
+    bool invariant;
+    bool has_operation;
+};
+
+// Moves the computations whose operands don't change inside a loop to right before the loop,
+// saving their results in fresh variables that the loop loads instead.
+// Only pure operations that can't fail are moved, since the loop body might not run at all.
+bool hoist_loop_invariants(vector<Quad> &quads)
+{
+    Cfg cfg(quads);
+    cfg.compute_assigned();
+    for (Loop &loop : cfg.find_loops())
+    {
+        int pre = find_preheader(cfg, loop);
+        if (pre == -1)
+            continue;
+        set<string> writes = loop_writes(quads, cfg, loop);
+        set<string> &assigned = cfg.blocks[pre].assigned_out;
+
+        // Simulate the stack of every block, keeping the invariant computations that get consumed by variant ones.
+        vector<pair<int, int>> candidates;
+        for (int b : loop.blocks)
+        {
+            vector<Computation> stack;
+            auto consume = [&](Computation c)
+            {
+                if (c.invariant && c.has_operation)
+                    candidates.push_back({c.start, c.end});
+            };
+            for (int i = cfg.blocks[b].start; i < cfg.blocks[b].end; i++)
+            {
+                Quad &q = quads[i];
+                if (!q.is_code() || q.is_label())
+                    continue;
+                int pops, pushes;
+                stack_effect(q, pops, pushes);
+                vector<Computation> operands(pops, Computation{-1, -1, false, false});
+                for (int j = pops - 1; j >= 0 && !stack.empty(); j--)
+                {
+                    operands[j] = stack.back();
+                    stack.pop_back();
+                }
+
+                bool pure = pushes == 1 && pops > 0 && q.op != "DUP" && q.op != "CALL" && !q.is_array_op();
+                // Division is only safe when it can't be by zero.
+                if (q.op == "DIV")
+                    pure &= operands[1].end - operands[1].start == 1 && is_immediate(quads[operands[1].start].arg) && atof(quads[operands[1].start].arg.c_str()) != 0.0;
+                // The operands have to be computed one right after the other, otherwise the quads in between
+                // (like an inlined PRINT) would be moved along with them.
+                bool invariant = pure;
+                for (int j = 0; j < pops; j++)
+                    invariant &= operands[j].invariant && operands[j].end == (j + 1 < pops ? operands[j + 1].start : i);
+                if (q.op == "PUSH")
+                    stack.push_back({i, i + 1, !q.is_load() || (!writes.count(q.arg) && assigned.count(q.arg)), false});
+                else if (invariant)
+                    stack.push_back({operands[0].start, i + 1, true, true});
+                else
+                {
+                    for (Computation &c : operands)
+                        consume(c);
+                    for (int j = 0; j < pushes; j++)
+                        stack.push_back({i, i + 1, false, false});
+                }
+            }
+            // Whatever is left is consumed in another block.
+            for (Computation &c : stack)
+                consume(c);
+        }
+        if (candidates.empty())
+            continue;
+
+        // Identical computations share the same variable.
+        map<string, string> variables;
+        map<int, pair<int, string>> ranges;
+        vector<Quad> code;
+        for (auto &candidate : candidates)
+        {
+            string text;
+            for (int i = candidate.first; i < candidate.second; i++)
+                text += quads[i].str() + "\n";
+            if (!variables.count(text))
+            {
+                variables[text] = fresh_variable("inv");
+                code.insert(code.end(), quads.begin() + candidate.first, quads.begin() + candidate.second);
+                code.push_back(Quad("POP", variables[text]));
+            }
+            ranges[candidate.first] = {candidate.second, variables[text]};
+        }
+        rewrite_loop(quads, ranges, cfg.blocks[loop.header].start, code);
+        return true;
+    }
+    return false;
+}
+
+// Whether the quad at `index` is a PUSH of an integer immediate.
+bool is_int_push(vector<Quad> &quads, int index)
+{
+    return index >= 0 && index < quads.size() && quads[index].op == "PUSH" && is_immediate(quads[index].arg) && immediate_type(quads[index].arg) == INTEGER;
+}
+
+// Strength reduction: a loop variable `i` that only changes by `i = i + c` makes `i * k` (and `i * k + d`)
+// change by `c * k` every iteration, so it is kept in a fresh variable updated right after `i` instead of
+// being multiplied over again. The update costs 4 quads per iteration, so it is only done when it saves more.
+bool reduce_induction_variables(vector<Quad> &quads)
+{
+    Cfg cfg(quads);
+    cfg.compute_assigned();
+    for (Loop &loop : cfg.find_loops())
+    {
+        int pre = find_preheader(cfg, loop);
+        if (pre == -1)
+            continue;
+
+        // The basic induction variables and the index of their only store in the loop.
+        map<string, int> stores;
+        set<string> called;
+        for (int b : loop.blocks)
+            for (int i = cfg.blocks[b].start; i < cfg.blocks[b].end; i++)
+                if (quads[i].is_store())
+                    stores[quads[i].arg] = stores.count(quads[i].arg) ? -1 : i;
+                else if (quads[i].op == "CALL")
+                    called.insert(cfg.func_refs[quads[i].arg].begin(), cfg.func_refs[quads[i].arg].end());
+        for (auto &store : stores)
+        {
+            string var = store.first;
+            int s = store.second;
+            if (s < 3 || called.count(var) || !cfg.blocks[pre].assigned_out.count(var) || quads[s - 3].op != "PUSH" ||
+                quads[s - 3].arg != var || !is_int_push(quads, s - 2) || (quads[s - 1].op != "PLUS" && quads[s - 1].op != "MINUS"))
+                continue;
+            int step = atoi(quads[s - 2].arg.c_str()) * (quads[s - 1].op == "PLUS" ? 1 : -1);
+
+            // Group the uses by the expression they compute, `i * k` or `k * i` optionally followed by `+ d` or `- d`.
+            map<string, vector<pair<int, int>>> uses;
+            map<string, int> factors;
+            for (int b : loop.blocks)
+                for (int i = cfg.blocks[b].start; i + 2 < cfg.blocks[b].end; i++)
+                {
+                    bool var_first = quads[i].op == "PUSH" && quads[i].arg == var && is_int_push(quads, i + 1);
+                    bool var_second = is_int_push(quads, i) && quads[i + 1].op == "PUSH" && quads[i + 1].arg == var;
+                    if ((!var_first && !var_second) || quads[i + 2].op != "MULT")
+                        continue;
+                    int end = i + 3;
+                    if (is_int_push(quads, end) && end + 1 < cfg.blocks[b].end && (quads[end + 1].op == "PLUS" || quads[end + 1].op == "MINUS"))
+                        end += 2;
+                    string text;
+                    for (int j = i; j < end; j++)
+                        text += (j == i + (var_first ? 0 : 1) ? "" : quads[j].str()) + "\n";
+                    uses[text].push_back({i, end});
+                    factors[text] = atoi(quads[var_first ? i + 1 : i].arg.c_str());
+                }
+
+            for (auto &use : uses)
+            {
+                int saved = 0;
+                for (auto &range : use.second)
+                    saved += range.second - range.first - 1;
+                if (saved <= 4)
+                    continue;
+
+                string derived = fresh_variable("iv");
+                map<int, pair<int, string>> ranges;
+                for (auto &range : use.second)
+                    ranges[range.first] = {range.second, derived};
+                vector<Quad> init(quads.begin() + use.second[0].first, quads.begin() + use.second[0].second);
+                init.push_back(Quad("POP", derived));
+                // Update the derived variable right after the induction variable, the ranges after it shift by 4.
+                vector<Quad> update = {Quad("PUSH", derived), Quad("PUSH", to_string(step * factors[use.first])), Quad("PLUS", ""), Quad("POP", derived)};
+                quads.insert(quads.begin() + s + 1, update.begin(), update.end());
+                map<int, pair<int, string>> shifted;
+                for (auto &range : ranges)
+                    if (range.first > s)
+                        shifted[range.first + 4] = {range.second.first + 4, derived};
+                    else
+                        shifted[range.first] = range.second;
+                rewrite_loop(quads, shifted, cfg.blocks[loop.header].start, init);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Replaces the calls to pure functions with immediate arguments by the value they return, computed by
+// running them at compile time. Calls that don't finish within the step budget are left as they are.
+bool evaluate_pure_calls(vector<Quad> &quads)
+{
+    Cfg cfg(quads);
+    cfg.compute_liveness();
+    Evaluator evaluator(quads, cfg);
+    vector<bool> removed(quads.size(), false);
+    bool changed = false;
+    for (int i = 0; i < quads.size(); i++)
+    {
+        if (quads[i].op != "CALL" || !cfg.blocks[cfg.block_of[i]].reachable)
+            continue;
+        // The arguments have to be pushed right before the call, in the same block. The ones of a nested call
+        // evaluated just before are already removed, its result is the last argument pushed.
+        int arity = func_arity[quads[i].arg];
+        vector<string> args;
+        vector<int> pushes;
+        for (int j = i - 1; j >= 0 && pushes.size() < arity && cfg.block_of[j] == cfg.block_of[i]; j--)
+        {
+            if (removed[j])
+                continue;
+            if (quads[j].op != "PUSH" || !is_immediate(quads[j].arg))
+                break;
+            args.insert(args.begin(), quads[j].arg);
+            pushes.push_back(j);
+        }
+        string result;
+        if (args.size() != arity || !evaluator.evaluate_call(quads[i].arg, args, result))
+            continue;
+        for (int j : pushes)
+            removed[j] = true;
+        quads[i] = Quad("PUSH", result);
+        changed = true;
+    }
+    sweep(quads, removed);
+    return changed;
+}
+
+// Functions this small (in quads) are inlined at every call site, bigger ones only when called once.
+#define MAX_INLINE_QUADS 32
+// Inlining stops before the program gets this many times bigger (in instructions) than it was compiled.
+#define MAX_INLINE_GROWTH 2
+
+// The number of instructions among the quads, not counting labels and comments.
+int count_instructions(vector<Quad> &quads)
+{
+    int count = 0;
+    for (Quad &q : quads)
+        count += q.is_code() && !q.is_label();
+    return count;
+}
+
+// The index of the label ending the definition of the function defined at `def`.
+int find_func_end(vector<Quad> &quads, int def)
+{
+    string end = func_end_label(quads[def].arg);
+    for (int i = def + 1; i < quads.size(); i++)
+        if (quads[i].op == "LABEL" && quads[i].arg == end)
+            return i;
+    return quads.size();
+}
+
+// Copies the body of a function in place of a call to it: the arguments are already on the stack for the
+// parameters to pop, and returns jump to the end of the copy leaving the returned value on the stack.
+// Labels are made unique with `prefix`, and so are the variables that nobody outside the function can observe.
+vector<Quad> inline_body(vector<Quad> &body, set<string> &renamed, string prefix)
+{
+    vector<Quad> copy;
+    for (Quad q : body)
+    {
+        if (q.op == "LABEL" || q.is_jump() || ((q.is_load() || q.is_store()) && renamed.count(q.arg)))
+            q.arg = prefix + q.arg;
+        else if (q.op == "RET")
+            q = Quad("JMP", prefix + "end");
+        copy.push_back(q);
+    }
+    copy.push_back(Quad("LABEL", prefix + "end"));
+    return copy;
+}
+
+// Inlines small functions into their callers, saving the CALL and RET and letting the other passes fold
+// the body with the arguments it is called with. Recursive functions and the ones defining other
+// functions are left alone. The functions are visited callees first, so each one is inlined into the
+// bodies of its callers before their own size is looked at, and all of them are inlined in one go as long
+// as the program stays within `max_size` instructions.
+bool inline_functions(vector<Quad> &quads, int max_size)
+{
+    Cfg cfg(quads);
+    cfg.compute_liveness();
+    map<string, int> call_sites;
+    for (Quad &q : quads)
+        if (q.op == "CALL")
+            call_sites[q.arg]++;
+
+    // The bodies of the functions that can be inlined, the functions they call, and the variables that can
+    // get a fresh copy per call site: the ones the function always writes before reading them, as long
+    // as nothing outside the function reads them.
+    map<string, vector<Quad>> bodies;
+    map<string, set<string>> callees, renamed;
+    map<string, pair<int, int>> spans;
+    for (int def = 0; def < quads.size(); def++)
+    {
+        string func = quads[def].arg;
+        if (quads[def].op != "DEF" || !call_sites[func] || cfg.is_recursive(func))
+            continue;
+        int end = find_func_end(quads, def);
+        vector<Quad> body;
+        set<string> calls, vars;
+        bool nested = false;
+        for (int i = def + 1; i < end; i++)
+        {
+            Quad &q = quads[i];
+            nested |= q.op == "DEF";
+            if (q.op == "CALL")
+                calls.insert(q.arg);
+            if ((q.is_load() || q.is_store()) && !cfg.func_escaping[func].count(q.arg) &&
+                !cfg.blocks[cfg.label_block[func]].live_in.count(q.arg))
+                vars.insert(q.arg);
+            if (q.is_code())
+                body.push_back(q);
+        }
+        if (nested)
+            continue;
+        bodies[func] = body;
+        callees[func] = calls;
+        renamed[func] = vars;
+        spans[func] = make_pair(def, end);
+    }
+
+    vector<string> order;
+    set<string> visited;
+    for (auto &body : bodies)
+        order_callees_first(body.first, callees, visited, order);
+
+    // Each copy replaces a CALL and the function itself is dropped once it is inlined everywhere.
+    int size = count_instructions(quads);
+    set<string> inlined;
+    for (string func : order)
+    {
+        if (!bodies.count(func))
+            continue;
+        vector<Quad> body;
+        for (Quad &q : bodies[func])
+            if (q.op == "CALL" && inlined.count(q.arg))
+            {
+                string prefix = fresh_variable("inl") + "_";
+                vector<Quad> copy = inline_body(bodies[q.arg], renamed[q.arg], prefix);
+                body.insert(body.end(), copy.begin(), copy.end());
+                for (string var : renamed[q.arg])
+                    renamed[func].insert(prefix + var);
+            }
+            else
+                body.push_back(q);
+        bodies[func] = body;
+        int body_size = count_instructions(body);
+        int growth = (call_sites[func] - 1) * body_size - call_sites[func];
+        if ((body_size <= MAX_INLINE_QUADS || call_sites[func] == 1) && size + growth <= max_size)
+        {
+            inlined.insert(func);
+            size += growth;
+        }
+    }
+    if (inlined.empty())
+        return false;
+
+    // The code of the inlined functions is dropped, the jump over it and its comments are cleaned up later.
+    vector<bool> dropped(quads.size(), false);
+    for (string func : inlined)
+        for (int i = spans[func].first; i < spans[func].second; i++)
+            dropped[i] = quads[i].is_code();
+    vector<Quad> result;
+    for (int i = 0; i < quads.size(); i++)
+        if (dropped[i])
+            continue;
+        else if (quads[i].op == "CALL" && inlined.count(quads[i].arg))
+        {
+            string func = quads[i].arg;
+            vector<Quad> copy = inline_body(bodies[func], renamed[func], fresh_variable("inl") + "_");
+            result.insert(result.end(), copy.begin(), copy.end());
+        }
+        else
+            result.push_back(quads[i]);
+    quads = result;
+    return true;
+}
+
+// The index of the instruction that runs right after the one at `index`, looking past labels and
+// following unconditional jumps. -1 if there is none or the jumps loop forever.
+int next_instruction(vector<Quad> &quads, map<string, int> &labels, int index)
+{
+    for (int steps = 0; steps < quads.size(); steps++)
+    {
+        index++;
+        while (index < quads.size() && (!quads[index].is_code() || quads[index].is_label()))
+            index++;
+        if (index >= quads.size() || quads[index].op != "JMP")
+            return index < quads.size() ? index : -1;
+        index = labels[quads[index].arg];
+    }
+    return -1;
+}
+
+// Turns the calls whose value is returned right away into TAILCALLs, which jump into the callee without
+// pushing a return address, so the callee returns straight to the caller's caller and tail recursion
+// runs in constant stack space. It runs after the other passes since they expect every call to come back.
+bool form_tail_calls(vector<Quad> &quads)
+{
+    map<string, int> labels;
+    for (int i = 0; i < quads.size(); i++)
+        if (quads[i].is_label())
+            labels[quads[i].arg] = i;
+    bool changed = false;
+    for (int i = 0; i < quads.size(); i++)
+        if (quads[i].op == "CALL")
+        {
+            int next = next_instruction(quads, labels, i);
+            if (next != -1 && quads[next].op == "RET")
+            {
+                quads[i].op = "TAILCALL";
+                changed = true;
+            }
+        }
+    // The RETs (and jumps to them) after the new TAILCALLs are never reached.
+    if (changed)
+    {
+        remove_unreachable(quads);
+        simplify_jumps(quads);
+    }
+    return changed;
+}
+
+// Drops the comments around statements that got optimized away entirely.
+void remove_empty_statements(vector<Quad> &quads)
+{
+    vector<bool> removed(quads.size(), false);
+    for (int i = 0; i < quads.size(); i++)
+    {
+        if (quads[i].is_code() || quads[i].arg == "")
+            continue;
+        int j = i + 1;
+        while (j < quads.size() && (removed[j] || (!quads[j].is_code() && quads[j].arg == "")))
+            j++;
+        if (j < quads.size() && !quads[j].is_code() && quads[j].arg == quads[i].arg)
+        {
+            for (int k = i; k <= j; k++)
+                removed[k] = true;
+            // Look back for an enclosing statement that became empty as well.
+            for (i--; i >= 0 && (removed[i] || (!quads[i].is_code() && quads[i].arg == "")); i--)
+                ;
+            i = max(i - 1, -1);
+        }
+    }
+    // Leave at most two blank lines in a row.
+    for (int i = 0, blanks = 0; i < quads.size(); i++)
+        if (!removed[i])
+        {
+            blanks = !quads[i].is_code() && quads[i].arg == "" ? blanks + 1 : 0;
+            removed[i] = blanks > 2;
+        }
+    sweep(quads, removed);
+}
+
+// Runs the optimization passes over the quad file in place until none of them changes anything.
+void optimize_quads(string path)
+{
+    vector<Quad> quads = read_quads(path);
+    compute_func_arity(quads);
+    int max_size = MAX_INLINE_GROWTH * count_instructions(quads);
+    for (bool changed = true; changed;)
+    {
+        changed = false;
+        changed |= evaluate_pure_calls(quads);
+        changed |= inline_functions(quads, max_size);
+        changed |= remove_unreachable(quads);
+        changed |= propagate_constants(quads);
+        changed |= simplify_jumps(quads);
+        changed |= eliminate_dead_stores(quads);
+        changed |= hoist_loop_invariants(quads);
+        changed |= reduce_induction_variables(quads);
+    }
+    form_tail_calls(quads);
+    remove_empty_statements(quads);
+    write_quads(path, quads);
+}
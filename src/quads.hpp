@@ -12,6 +12,7 @@
 
 #define q_int2real() quadout << "\tINT2REAL" << endl
 #define q_real2int() quadout << "\tREAL2INT" << endl
+#define q_opaque() quadout << "\tOPAQUE" << endl
 
 #define q_funcdef(name, scp) quadout << "\tJMP fend_" << name << scp << endl << "DEF f_" << name << scp << ":" << endl
 #define q_funcall(name) quadout << "\tCALL f_" << name << get_scope(name) << endl
@@ -20,19 +21,31 @@
 
 #define q_print() quadout << "\tPRINT" << endl
 
-// Operations.
-#define q_neg() quadout << "\tNEG" << endl
-#define q_plus() quadout << "\tPLUS" << endl
-#define q_minus() quadout << "\tMINUS" << endl
-#define q_mult() quadout << "\tMULT" << endl
-#define q_div() quadout << "\tDIV" << endl
-
-#define q_lt() quadout << "\tLT" << endl
-#define q_gt() quadout << "\tGT" << endl
-#define q_lte() quadout << "\tLTEQ" << endl
-#define q_gte() quadout << "\tGTEQ" << endl
-#define q_eq() quadout << "\tEQ" << endl
-#define q_ne() quadout << "\tNEQ" << endl
+// Operations, done element-wise by their V prefixed versions when the result (`expr`) is an array.
+#define q_oper(expr, op) quadout << "\t" << (expr->is_array() ? "V" : "") << op << endl
+#define q_neg(expr) q_oper(expr, "NEG")
+#define q_plus(expr) q_oper(expr, "PLUS")
+#define q_minus(expr) q_oper(expr, "MINUS")
+#define q_mult(expr) q_oper(expr, "MULT")
+#define q_div(expr) q_oper(expr, "DIV")
+
+#define q_lt(expr) q_oper(expr, "LT")
+#define q_gt(expr) q_oper(expr, "GT")
+#define q_lte(expr) q_oper(expr, "LTEQ")
+#define q_gte(expr) q_oper(expr, "GTEQ")
+#define q_eq(expr) q_oper(expr, "EQ")
+#define q_ne(expr) q_oper(expr, "NEQ")
+
+// Arrays.
+#define q_array(n) quadout << "\tARRAY " << n << endl
+#define q_fill() quadout << "\tFILL" << endl
+#define q_copy() quadout << "\tCOPY" << endl
+#define q_vget() quadout << "\tVGET" << endl
+#define q_vset() quadout << "\tVSET" << endl
+#define q_vlen() quadout << "\tVLEN" << endl
+#define q_vsum() quadout << "\tVSUM" << endl
+#define q_vmin() quadout << "\tVMIN" << endl
+#define q_vmax() quadout << "\tVMAX" << endl
 
 #define q_and() quadout << "\tAND" << endl
 #define q_or() quadout << "\tOR" << endl